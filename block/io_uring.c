@@ -0,0 +1,457 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+
+#include <liburing.h>
+
+/*
+ * Submission and completion queue size, per AioContext.  Requests that do
+ * not fit in the submission queue wait in io_q.pending.
+ */
+#define MAX_ENTRIES 128
+
+/*
+ * Size of the registered file table.  Files that do not fit are submitted
+ * through their plain file descriptor.
+ */
+#define MAX_FILES 64
+
+/* How long the kernel submission thread spins before going to sleep */
+#define SQ_THREAD_IDLE_MS 1000
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may return short even before EOF; the rest of the
+     * request is resubmitted from resubmit_qiov.
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* fixed file table, -1 for free slots; NULL if not supported */
+    int *files;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+};
+
+static void ioq_submit(LuringState *s);
+
+/*
+ * Completes an AIO request.  For short reads, the rest of the request is
+ * queued again and the coroutine is not woken up yet.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb,
+                                      int ret)
+{
+    if (ret == -EINTR || ret == -EAGAIN) {
+        QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+        s->io_q.in_queue++;
+        return;
+    }
+
+    if (luringcb->is_read && ret >= 0) {
+        int total = luringcb->total_read + ret;
+
+        if (ret > 0 && total < luringcb->qiov->size) {
+            /* Short read: resubmit what is left */
+            luringcb->total_read = total;
+            if (luringcb->resubmit_qiov.iov == NULL) {
+                qemu_iovec_init(&luringcb->resubmit_qiov,
+                                luringcb->qiov->niov);
+            } else {
+                qemu_iovec_reset(&luringcb->resubmit_qiov);
+            }
+            qemu_iovec_concat(&luringcb->resubmit_qiov, luringcb->qiov,
+                              total, luringcb->qiov->size - total);
+            luringcb->sqeq.off += ret;
+            luringcb->sqeq.addr =
+                (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
+            luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+            QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+            s->io_q.in_queue++;
+            return;
+        }
+
+        /* Zero-length read means EOF, pad with zeros */
+        if (total < luringcb->qiov->size) {
+            qemu_iovec_memset(luringcb->qiov, total, 0,
+                              luringcb->qiov->size - total);
+        }
+        ret = 0;
+    } else if (ret >= 0) {
+        ret = (ret == luringcb->qiov->size) ? 0 : -ENOSPC;
+    }
+
+    if (luringcb->resubmit_qiov.iov != NULL) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+
+    luringcb->ret = ret;
+    /* If the coroutine is already entered it must be in ioq_submit() and
+     * will notice luringcb->ret has been filled in when it eventually runs
+     * later.  Coroutines cannot be entered recursively so avoid doing
+     * that!
+     */
+    if (!qemu_coroutine_entered(luringcb->co)) {
+        qemu_coroutine_enter(luringcb->co);
+    }
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests and invokes their callbacks.
+ *
+ * Like its linux-aio counterpart, this supports nested event loops: the
+ * completion BH is kept scheduled while callbacks run, so that a callback
+ * that calls aio_poll() still sees the remaining completions.  Each CQE is
+ * consumed before its callback runs, so no index has to be shared with the
+ * nested invocation.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        luring_process_completion(s, luringcb, ret);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    luring_process_completions(s);
+    if (!s->io_q.plugged && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_process_completions_and_submit(s);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+    struct io_uring_cqe *cqe;
+
+    if (io_uring_peek_cqe(&s->ring, &cqe) != 0) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * Move pending requests to the submission queue and tell the kernel about
+ * them with a single io_uring_enter().  With SQ polling the kernel thread
+ * usually picks them up without a system call at all.
+ */
+static void ioq_submit(LuringState *s)
+{
+    struct io_uring_sqe *sqe;
+    LuringAIOCB *luringcb;
+    int ret, len;
+
+    do {
+        len = 0;
+        while (s->io_q.in_flight + len < MAX_ENTRIES &&
+               (luringcb = QSIMPLEQ_FIRST(&s->io_q.pending)) &&
+               (sqe = io_uring_get_sqe(&s->ring))) {
+            *sqe = luringcb->sqeq;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            len++;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        /* On -EAGAIN or -EBUSY the SQEs stay in the ring and are picked up
+         * by the next io_uring_enter(), so they count as in flight anyway.
+         * The same holds for any other error: the SQEs are already visible
+         * to the kernel, so the requests cannot be failed here without
+         * risking a completion for a request that was already finished.
+         */
+        ret = io_uring_submit(&s->ring);
+        if (ret < 0 && ret != -EAGAIN && ret != -EBUSY && ret != -EINTR) {
+            error_report("io_uring_submit failed: %s", strerror(-ret));
+        }
+        s->io_q.in_flight += len;
+        s->io_q.in_queue -= len;
+    } while (s->io_q.in_flight < MAX_ENTRIES &&
+             !QSIMPLEQ_EMPTY(&s->io_q.pending));
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /* We can try to complete something just right away if there are
+         * still requests in-flight. */
+        luring_process_completions(s);
+    }
+    if (s->io_q.in_flight == 0 && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        /* Everything that was queued again has no completion to wait for */
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+}
+
+/*
+ * Return the slot of @fd in the registered file table, registering it if
+ * needed, or -1 if it cannot be registered.
+ */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i, free_slot = -1;
+
+    if (!s->files) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FILES; i++) {
+        if (s->files[i] == fd) {
+            return i;
+        }
+        if (s->files[i] == -1 && free_slot == -1) {
+            free_slot = i;
+        }
+    }
+    if (free_slot == -1 ||
+        io_uring_register_files_update(&s->ring, free_slot, &fd, 1) != 1) {
+        return -1;
+    }
+    s->files[free_slot] = fd;
+    return free_slot;
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int i, none = -1;
+
+    if (!s->files) {
+        return;
+    }
+    for (i = 0; i < MAX_FILES; i++) {
+        if (s->files[i] == fd) {
+            io_uring_register_files_update(&s->ring, i, &none, 1);
+            s->files[i] = -1;
+            return;
+        }
+    }
+}
+
+static int luring_do_submit(LuringState *s, int fd, LuringAIOCB *luringcb,
+                            uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int slot = luring_fixed_file(s, fd);
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqes, slot >= 0 ? slot : fd,
+                             luringcb->qiov->iov, luringcb->qiov->niov,
+                             offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqes, slot >= 0 ? slot : fd,
+                            luringcb->qiov->iov, luringcb->qiov->niov,
+                            offset);
+        break;
+    default:
+        error_report("%s: invalid AIO request type 0x%x", __func__, type);
+        return -EIO;
+    }
+    if (slot >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    ret = luring_do_submit(s, fd, &luringcb, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           luring_completion_cb, luring_poll_cb);
+}
+
+LuringState *luring_init(bool sqpoll, Error **errp)
+{
+    LuringState *s;
+    struct io_uring_params p;
+    int ret, i;
+
+    s = g_new0(LuringState, 1);
+    if (event_notifier_init(&s->e, false) < 0) {
+        error_setg(errp, "Failed to initialize event notifier");
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQ_THREAD_IDLE_MS;
+    }
+    ret = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to set up io_uring");
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to register io_uring eventfd");
+        goto out_exit_ring;
+    }
+
+    /* A sparse table needs IORING_REGISTER_FILES_UPDATE (Linux 5.5) */
+    s->files = g_new(int, MAX_FILES);
+    for (i = 0; i < MAX_FILES; i++) {
+        s->files[i] = -1;
+    }
+    if (io_uring_register_files(&s->ring, s->files, MAX_FILES) < 0) {
+        g_free(s->files);
+        s->files = NULL;
+    }
+
+    ioq_init(&s->io_q);
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s->files);
+    g_free(s);
+}
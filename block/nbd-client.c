@@ -28,12 +28,13 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "nbd-client.h"
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
 
-static void nbd_recv_coroutines_enter_all(NBDClientSession *s)
+static void nbd_recv_coroutines_enter_all(NBDClientConnection *s)
 {
     int i;
 
@@ -44,31 +45,29 @@ static void nbd_recv_coroutines_enter_all(NBDClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDClientConnection *s)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-
-    if (!client->ioc) { /* Already closed */
+    if (!s->ioc) { /* Already closed */
         return;
     }
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
+    qio_channel_shutdown(s->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    nbd_recv_coroutines_enter_all(client);
-
-    nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+    nbd_recv_coroutines_enter_all(s);
+
+    aio_set_fd_handler(bdrv_get_aio_context(s->bs), s->sioc->fd,
+                       false, NULL, NULL, NULL, NULL);
+    object_unref(OBJECT(s->sioc));
+    s->sioc = NULL;
+    object_unref(OBJECT(s->ioc));
+    s->ioc = NULL;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NBDClientSession *s = nbd_get_client_session(bs);
+    NBDClientConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -105,21 +104,20 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NBDClientConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine);
+    qemu_coroutine_enter(s->send_coroutine);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDClientConnection *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -142,10 +140,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
     }
 
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, NULL, s);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -161,88 +159,240 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NBDClientSession *s,
+static int nbd_co_read_payload(NBDClientConnection *s, void *buf,
+                               size_t len)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    return nbd_wr_syncv(s->ioc, &iov, 1, len, true) == len ? 0 : -EIO;
+}
+
+/* Check that a chunk for [@offset, @offset + @len) lies within @request */
+static bool nbd_chunk_in_request(NBDRequest *request, uint64_t offset,
+                                 uint32_t len)
+{
+    return offset >= request->from && len <= request->len &&
+           offset - request->from <= request->len - len;
+}
+
+/* Consume the payload of the structured reply chunk in @reply.  Data and
+ * holes go to @qiov, a block status extent to @extent.  Return -EIO if the
+ * server sent something that does not fit the request, after which the
+ * connection cannot be used anymore. */
+static int nbd_co_receive_chunk(NBDClientConnection *s,
+                                NBDRequest *request,
+                                NBDReply *reply,
+                                QEMUIOVector *qiov,
+                                NBDExtent *extent)
+{
+    QEMUIOVector sub_qiov;
+    uint8_t buf[8 + 4];
+    uint64_t offset;
+    uint32_t len, id;
+    ssize_t ret;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return reply->length ? -EIO : 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || reply->length < 8 ||
+            nbd_co_read_payload(s, buf, 8) < 0) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = reply->length - 8;
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            return -EIO;
+        }
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset - request->from, len);
+        ret = nbd_wr_syncv(s->ioc, sub_qiov.iov, sub_qiov.niov, len, true);
+        qemu_iovec_destroy(&sub_qiov);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || reply->length != 8 + 4 ||
+            nbd_co_read_payload(s, buf, 8 + 4) < 0) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* We always send NBD_CMD_FLAG_REQ_ONE, so expect a single extent */
+        if (!extent || reply->length != 4 + 8 ||
+            nbd_co_read_payload(s, buf, 4 + 8) < 0) {
+            return -EIO;
+        }
+        id = ldl_be_p(buf);
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        if (id != nbd_get_client_session(s->bs)->info.meta_base_allocation_id ||
+            !extent->length) {
+            return -EIO;
+        }
+        extent->length = MIN(extent->length, request->len);
+        return 0;
+
+    default:
+        return nbd_receive_error_chunk(s->ioc, reply) < 0 ? -EIO : 0;
+    }
+}
+
+static void nbd_co_receive_reply(NBDClientConnection *s,
                                  NBDRequest *request,
                                  NBDReply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov,
+                                 NBDExtent *extent)
 {
     int ret;
+    int error = 0;
+    bool done = false;
+
+    /* A simple reply ends the request at once; structured replies can
+     * come as several chunks, each of which wakes us up again. */
+    while (!done) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle ||
+            !s->ioc) {
+            error = EIO;
+            break;
+        }
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
+            }
+            done = true;
+        } else {
+            done = reply->flags & NBD_REPLY_FLAG_DONE;
+            if (nbd_co_receive_chunk(s, request, reply, qiov, extent) < 0) {
+                /* Make the read handler drop the connection */
+                qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
                 reply->error = EIO;
+                done = true;
             }
         }
+        if (!error) {
+            error = reply->error;
+        }
 
         /* Tell the read handler to read another header.  */
         s->reply.handle = 0;
     }
+    reply->error = error;
 }
 
-static void nbd_coroutine_start(NBDClientSession *s,
-                                NBDRequest *request)
+/* Pick the open connection with the fewest requests in flight.  Return
+ * NULL if all connections are closed. */
+static NBDClientConnection *nbd_coroutine_start(NBDClientSession *client)
 {
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight == MAX_NBD_REQUESTS) {
-        qemu_co_queue_wait(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    NBDClientConnection *s;
+    bool open;
+    int i;
+
+    /* Poor man semaphore.  The free_sema is locked when no connection
+     * can accept another request, and unlocked after receiving one
+     * reply.  */
+    for (;;) {
+        s = NULL;
+        open = false;
+        for (i = 0; i < client->num_conns; i++) {
+            NBDClientConnection *conn = &client->conns[i];
+
+            if (!conn->ioc) {
+                continue;
+            }
+            open = true;
+            if (conn->in_flight < MAX_NBD_REQUESTS &&
+                (!s || conn->in_flight < s->in_flight)) {
+                s = conn;
+            }
+        }
+        if (s || !open) {
+            break;
+        }
+        qemu_co_queue_wait(&client->free_sema);
+    }
+
+    if (s) {
+        s->in_flight++;
     }
-    s->in_flight++;
 
     /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    return s;
 }
 
-static void nbd_coroutine_end(NBDClientSession *s,
+static void nbd_coroutine_end(NBDClientSession *client,
+                              NBDClientConnection *s,
                               NBDRequest *request)
 {
     int i = HANDLE_TO_INDEX(s, request->handle);
     s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_queue_next(&s->free_sema);
+    s->in_flight--;
+    qemu_co_queue_next(&client->free_sema);
+}
+
+/* Send @request on one of the connections and wait for its reply.  The
+ * payload of a write comes from @write_qiov, read data goes to
+ * @read_qiov and a block status extent to @extent. */
+static int nbd_co_request(BlockDriverState *bs,
+                          NBDRequest *request,
+                          QEMUIOVector *write_qiov,
+                          QEMUIOVector *read_qiov,
+                          NBDExtent *extent)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *s;
+    NBDReply reply;
+    ssize_t ret;
+
+    s = nbd_coroutine_start(client);
+    if (!s) {
+        return -EPIPE;
+    }
+    ret = nbd_co_send_request(s, request, write_qiov);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, request, &reply, read_qiov, extent);
     }
+    nbd_coroutine_end(client, s, request);
+    return -reply.error;
 }
 
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
         .len = bytes,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, qiov, NULL);
 }
 
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
@@ -254,8 +404,6 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
         .from = offset,
         .len = bytes,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     if (flags & BDRV_REQ_FUA) {
         assert(client->nbdflags & NBD_FLAG_SEND_FUA);
@@ -264,28 +412,18 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, qiov, NULL, NULL);
 }
 
 int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int count, BdrvRequestFlags flags)
 {
-    ssize_t ret;
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
         .len = count,
     };
-    NBDReply reply;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES)) {
         return -ENOTSUP;
@@ -299,23 +437,13 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
         request.flags |= NBD_CMD_FLAG_NO_HOLE;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
-    NBDReply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -324,15 +452,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
@@ -343,100 +463,223 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
         .from = offset,
         .len = count,
     };
-    NBDReply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    return nbd_co_request(bs, &request, NULL, NULL, NULL);
+}
+
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDRequest request = {
+        .type = NBD_CMD_BLOCK_STATUS,
+        .from = sector_num << BDRV_SECTOR_BITS,
+        .flags = NBD_CMD_FLAG_REQ_ONE,
+    };
+    NBDExtent extent = { 0 };
+    int ret;
+
+    *file = bs;
+    if (!client->info.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+
+    /* The last sector may extend past the end of an unaligned export */
+    request.len = MIN((uint64_t)MIN(nb_sectors, BDRV_REQUEST_MAX_SECTORS) <<
+                      BDRV_SECTOR_BITS, client->size - request.from);
+
+    ret = nbd_co_request(bs, &request, NULL, NULL, &extent);
     if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        return ret;
+    }
+    if (!extent.length) {
+        return -EIO;
     }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
 
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        /* Only the tail of an unaligned export; play safe */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+    *pnum = extent.length >> BDRV_SECTOR_BITS;
+    return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+           (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0) |
+           BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sioc) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->conns[i].sioc->fd,
+                               false, NULL, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sioc) {
+            aio_set_fd_handler(new_context, client->conns[i].sioc->fd,
+                               false, nbd_reply_ready, NULL, NULL,
+                               &client->conns[i]);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    for (i = 0; i < client->num_conns; i++) {
+        NBDClientConnection *s = &client->conns[i];
+
+        if (s->ioc == NULL) {
+            continue;
+        }
 
-    nbd_send_request(client->ioc, &request);
+        nbd_send_request(s->ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(s);
+    }
 }
 
-int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sioc,
-                    const char *export,
-                    QCryptoTLSCreds *tlscreds,
-                    const char *hostname,
-                    Error **errp)
+/* Negotiate on @sioc and add it to the connections of @bs.  Every
+ * connection after the first must see the same export. */
+static int nbd_client_connect(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
 {
     NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConnection *s = &client->conns[client->num_conns];
+    QIOChannel *ioc;
+    NBDExportInfo info;
+    uint16_t nbdflags;
+    off_t size;
     int ret;
 
+    assert(client->num_conns < NBD_MAX_CONNECTIONS);
+
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
+                                &nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+                                &ioc,
+                                &size, &info, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
-    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
-        bs->supported_write_flags = BDRV_REQ_FUA;
-        bs->supported_zero_flags |= BDRV_REQ_FUA;
-    }
-    if (client->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES) {
-        bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
+
+    if (client->num_conns == 0) {
+        client->nbdflags = nbdflags;
+        client->size = size;
+        client->info = info;
+    } else if (nbdflags != client->nbdflags || size != client->size ||
+               info.structured_reply != client->info.structured_reply ||
+               info.base_allocation != client->info.base_allocation ||
+               info.meta_base_allocation_id !=
+               client->info.meta_base_allocation_id) {
+        error_setg(errp, "NBD server changed the export between connections");
+        if (ioc) {
+            object_unref(OBJECT(ioc));
+        }
+        return -EINVAL;
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_queue_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
+    qemu_co_mutex_init(&s->send_mutex);
+    s->bs = bs;
+    s->sioc = sioc;
+    object_ref(OBJECT(s->sioc));
 
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    s->ioc = ioc;
+    if (!s->ioc) {
+        s->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(s->ioc));
     }
+    client->num_conns++;
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    aio_set_fd_handler(bdrv_get_aio_context(bs), sioc->fd,
+                       false, nbd_reply_ready, NULL, NULL, s);
+    return 0;
+}
+
+int nbd_client_init(BlockDriverState *bs,
+                    QIOChannelSocket *sioc,
+                    const char *export,
+                    QCryptoTLSCreds *tlscreds,
+                    const char *hostname,
+                    Error **errp)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int ret;
+
+    qemu_co_queue_init(&client->free_sema);
+    ret = nbd_client_connect(bs, sioc, export, tlscreds, hostname, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
+        bs->supported_write_flags = BDRV_REQ_FUA;
+        bs->supported_zero_flags |= BDRV_REQ_FUA;
+    }
+    if (client->nbdflags & NBD_FLAG_SEND_WRITE_ZEROES) {
+        bs->supported_zero_flags |= BDRV_REQ_MAY_UNMAP;
+    }
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+/* Open one more connection to a server that advertised
+ * NBD_FLAG_CAN_MULTI_CONN; requests are spread across all of them. */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NBDClientSession *client = nbd_get_client_session(bs);
+    int ret;
+
+    assert(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN);
+    ret = nbd_client_connect(bs, sioc, export, tlscreds, hostname, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    logout("Established connection %d with NBD server\n", client->num_conns);
+    return 0;
+}
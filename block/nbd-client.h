@@ -17,19 +17,33 @@
 
 #define MAX_NBD_REQUESTS    16
 
-typedef struct NBDClientSession {
+/* Maximum number of connections to a server that advertises
+ * NBD_FLAG_CAN_MULTI_CONN */
+#define NBD_MAX_CONNECTIONS 16
+
+typedef struct NBDClientConnection {
+    BlockDriverState *bs;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint16_t nbdflags;
-    off_t size;
 
     CoMutex send_mutex;
-    CoQueue free_sema;
     Coroutine *send_coroutine;
     int in_flight;
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     NBDReply reply;
+} NBDClientConnection;
+
+typedef struct NBDClientSession {
+    uint16_t nbdflags;
+    off_t size;
+    NBDExportInfo info;
+
+    /* Each request goes to the open connection with the fewest requests
+     * in flight; free_sema is waited on when all of them are full. */
+    NBDClientConnection conns[NBD_MAX_CONNECTIONS];
+    int num_conns;
+    CoQueue free_sema;
 
     bool is_unix;
 } NBDClientSession;
@@ -42,6 +56,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count);
@@ -52,6 +72,10 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int count, BdrvRequestFlags flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
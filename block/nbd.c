@@ -49,6 +49,7 @@ typedef struct BDRVNBDState {
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
     char *export, *tlscredsid;
+    int64_t connections;
 } BDRVNBDState;
 
 static int nbd_parse_uri(const char *filename, QDict *options)
@@ -382,6 +383,12 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server "
+                    "allows more than one (default 1)",
+        },
     },
 };
 
@@ -395,6 +402,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
     int ret = -EINVAL;
+    int i;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -416,6 +424,13 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     s->export = g_strdup(qemu_opt_get(opts, "export"));
 
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+
     s->tlscredsid = g_strdup(qemu_opt_get(opts, "tls-creds"));
     if (s->tlscredsid) {
         tlscreds = nbd_get_tls_creds(s->tlscredsid, errp);
@@ -442,6 +457,29 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, s->export,
                           tlscreds, hostname, errp);
+    if (ret < 0) {
+        goto error;
+    }
+
+    /* Servers that do not advertise multi-conn support get a single
+     * connection, as flushes on one connection might not cover writes
+     * completed on the others. */
+    for (i = 1; i < s->connections &&
+         (s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN); i++) {
+        object_unref(OBJECT(sioc));
+        sioc = nbd_establish_connection(s->saddr, errp);
+        if (!sioc) {
+            ret = -ECONNREFUSED;
+        } else {
+            ret = nbd_client_add_connection(bs, sioc, s->export,
+                                            tlscreds, hostname, errp);
+        }
+        if (ret < 0) {
+            nbd_client_close(bs);
+            goto error;
+        }
+    }
+
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -547,6 +585,9 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (s->tlscredsid) {
         qdict_put(opts, "tls-creds", qstring_from_str(s->tlscredsid));
     }
+    if (s->connections > 1) {
+        qdict_put(opts, "connections", qint_from_int(s->connections));
+    }
 
     qdict_flatten(opts);
     bs->full_open_options = opts;
@@ -564,6 +605,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -583,6 +625,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -602,6 +645,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
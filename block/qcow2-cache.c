@@ -33,6 +33,10 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Link in the LRU list; only entries with ref == 0 are on it */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -43,6 +47,15 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Hash index from table offset to entry; hash_mask + 1 buckets, each
+     * holding the index of the first entry in the chain or -1 */
+    int                    *hash_buckets;
+    unsigned int            hash_mask;
+
+    /* Unreferenced entries, least recently used first.  Unused entries
+     * (offset == 0) are kept at the head so they are recycled first. */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
@@ -62,6 +75,73 @@ static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
     return idx;
 }
 
+static inline unsigned int qcow2_cache_hash(BlockDriverState *bs,
+                                            Qcow2Cache *c, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    return (offset >> s->cluster_bits) & c->hash_mask;
+}
+
+static int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c,
+                              uint64_t offset)
+{
+    int i = c->hash_buckets[qcow2_cache_hash(bs, c, offset)];
+
+    while (i != -1 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+static void qcow2_cache_hash_insert(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    unsigned int bucket = qcow2_cache_hash(bs, c, c->entries[i].offset);
+
+    assert(c->entries[i].offset != 0);
+    c->entries[i].hash_next = c->hash_buckets[bucket];
+    c->hash_buckets[bucket] = i;
+}
+
+/* Drop entry @i from the hash index and mark it as unused */
+static void qcow2_cache_hash_remove(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    int *link;
+
+    if (c->entries[i].offset == 0) {
+        return;
+    }
+
+    link = &c->hash_buckets[qcow2_cache_hash(bs, c, c->entries[i].offset)];
+    while (*link != i) {
+        assert(*link != -1);
+        link = &c->entries[*link].hash_next;
+    }
+    *link = c->entries[i].hash_next;
+
+    c->entries[i].hash_next = -1;
+    c->entries[i].offset = 0;
+}
+
+/* Reset the hash index and put every (unreferenced) entry on the LRU list
+ * as unused */
+static void qcow2_cache_reset_index(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i <= c->hash_mask; i++) {
+        c->hash_buckets[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru_list);
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+        c->entries[i].offset = 0;
+        c->entries[i].lru_counter = 0;
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
+    }
+}
+
 static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
                                       int i, int num_tables)
 {
@@ -99,8 +179,10 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
+            qcow2_cache_hash_remove(bs, c, i);
             c->entries[i].lru_counter = 0;
+            QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru_entry);
+            QTAILQ_INSERT_HEAD(&c->lru_list, &c->entries[i], lru_entry);
             i++;
             to_clean++;
         }
@@ -123,14 +205,19 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * s->cluster_size);
+    c->hash_mask = pow2ceil(num_tables) - 1;
+    c->hash_buckets = g_try_new(int, c->hash_mask + 1);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->table_array || !c->hash_buckets) {
         qemu_vfree(c->table_array);
+        g_free(c->hash_buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qcow2_cache_reset_index(c);
+
     return c;
 }
 
@@ -143,6 +230,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->hash_buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -284,18 +372,14 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
-    int ret, i;
+    int ret;
 
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
-    for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
-    }
+    qcow2_cache_reset_index(c);
 
     qcow2_cache_table_release(bs, c, 0, c->size);
 
@@ -308,39 +392,29 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *victim;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(bs, c, offset);
+    if (i != -1) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    /* The least recently used unreferenced entry is the head of the list */
+    victim = QTAILQ_FIRST(&c->lru_list);
+    if (victim == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = victim - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -351,7 +425,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_hash_remove(bs, c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -361,15 +435,21 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                          qcow2_cache_get_table_addr(bs, c, i),
                          s->cluster_size);
         if (ret < 0) {
+            /* The entry is unused now, let it be recycled first */
+            QTAILQ_REMOVE(&c->lru_list, victim, lru_entry);
+            QTAILQ_INSERT_HEAD(&c->lru_list, victim, lru_entry);
             return ret;
         }
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(bs, c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru_entry);
+    }
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -399,6 +479,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     assert(c->entries[i].ref >= 0);
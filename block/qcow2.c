@@ -37,6 +37,7 @@
 #include "qemu/option_int.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -1163,6 +1164,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_wait_queue);
+    qemu_co_queue_init(&s->compress_order_queue);
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
 
     /* Repair image if dirty */
@@ -2552,6 +2555,112 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+/*
+ * qcow2_compress()
+ *
+ * @dest - destination buffer, at least @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: compressed size on success
+ *          -1 destination buffer is not enough to store compressed data
+ *          -2 on any other error
+ */
+static ssize_t qcow2_compress(void *dest, size_t dest_size,
+                              const void *src, size_t src_size)
+{
+    ssize_t ret;
+    z_stream strm;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -12, 9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -2;
+    }
+
+    /* strm.next_in is not const in old zlib versions, such as those used on
+     * OpenBSD/NetBSD, so cast the const away */
+    strm.avail_in = src_size;
+    strm.next_in = (void *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -1 : -2);
+    }
+
+    deflateEnd(&strm);
+
+    return ret;
+}
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = qcow2_compress(data->dest, data->dest_size,
+                               data->src, data->src_size);
+
+    return 0;
+}
+
+/* Compress a cluster in the thread pool so that several clusters can be
+ * deflated at the same time.  At most QCOW2_MAX_COMPRESS_THREADS requests
+ * per image are handed to the pool, further ones wait for a free slot. */
+static ssize_t coroutine_fn
+qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                  const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData arg = {
+        .dest = dest,
+        .dest_size = dest_size,
+        .src = src,
+        .src_size = src_size,
+    };
+
+    while (s->nb_compress_threads >= QCOW2_MAX_COMPRESS_THREADS) {
+        qemu_co_queue_wait(&s->compress_wait_queue);
+    }
+
+    s->nb_compress_threads++;
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &arg);
+    s->nb_compress_threads--;
+
+    qemu_co_queue_next(&s->compress_wait_queue);
+
+    return arg.ret;
+}
+
+/* Wait until all compressed writes submitted before request @seq have
+ * allocated their clusters */
+static void coroutine_fn qcow2_co_compress_wait_turn(BDRVQcow2State *s,
+                                                     uint64_t seq)
+{
+    while (s->compress_seq_done != seq) {
+        qemu_co_queue_wait(&s->compress_order_queue);
+    }
+}
+
+static void qcow2_compress_end_turn(BDRVQcow2State *s)
+{
+    s->compress_seq_done++;
+    qemu_co_queue_restart_all(&s->compress_order_queue);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static coroutine_fn int
@@ -2561,10 +2670,11 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     QEMUIOVector hd_qiov;
     struct iovec iov;
-    z_stream strm;
-    int ret, out_len;
+    int ret;
+    ssize_t out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
+    uint64_t seq;
 
     if (bytes == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2586,36 +2696,25 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
     }
     qemu_iovec_to_buf(qiov, 0, buf, bytes);
 
-    out_buf = g_malloc(s->cluster_size);
+    /* Several clusters are compressed at once, but they are allocated in
+     * the order the requests were submitted, so that writing the same data
+     * in the same order always produces the same image layout.  The
+     * sequence number must be taken before the first yield. */
+    seq = s->compress_seq_next++;
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    out_buf = g_malloc(s->cluster_size);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    qcow2_co_compress_wait_turn(s, seq);
+    if (out_len == -2) {
+        qcow2_compress_end_turn(s);
         ret = -EINVAL;
         goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    } else if (out_len == -1) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev(bs, offset, bytes, qiov, 0);
+        qcow2_compress_end_turn(s);
         if (ret < 0) {
             goto fail;
         }
@@ -2627,6 +2726,7 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
         qcow2_alloc_compressed_cluster_offset(bs, offset, out_len);
     if (!cluster_offset) {
         qemu_co_mutex_unlock(&s->lock);
+        qcow2_compress_end_turn(s);
         ret = -EIO;
         goto fail;
     }
@@ -2634,6 +2734,7 @@ qcow2_co_pwritev_compressed(BlockDriverState *bs, uint64_t offset,
 
     ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
     qemu_co_mutex_unlock(&s->lock);
+    qcow2_compress_end_turn(s);
     if (ret < 0) {
         goto fail;
     }
@@ -78,6 +78,10 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Maximum number of clusters of one image being compressed concurrently in
+ * the thread pool */
+#define QCOW2_MAX_COMPRESS_THREADS 16
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -256,6 +260,15 @@ typedef struct BDRVQcow2State {
 
     CoMutex lock;
 
+    /* Compressed writes waiting for a free compression slot */
+    CoQueue compress_wait_queue;
+    int nb_compress_threads;
+    /* Compressed clusters are allocated in the order the requests came in;
+     * these count requests submitted and allocated so far */
+    uint64_t compress_seq_next;
+    uint64_t compress_seq_done;
+    CoQueue compress_order_queue;
+
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
     uint32_t crypt_method_header;
     uint64_t snapshots_offset;
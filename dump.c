@@ -23,6 +23,9 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/memory_mapping.h"
 #include "sysemu/cpus.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "qemu/main-loop.h"
 #include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
 #include "qapi-event.h"
@@ -631,6 +634,224 @@ static void create_vmcore(DumpState *s, Error **errp)
     dump_iterate(s, errp);
 }
 
+/*
+ * Live dump
+ *
+ * In live mode only the layout of the vmcore is computed while the guest
+ * is stopped.  Guest memory is then copied while the guest keeps running,
+ * with dirty logging enabled; pages dirtied in the meantime are copied
+ * again, in place, until few enough remain.  The guest is paused only for
+ * the final pass, which also writes the ELF header and the CPU notes so
+ * that registers and memory are consistent with each other.
+ */
+#define DUMP_LIVE_MAX_PASSES        8
+#define DUMP_LIVE_FINAL_PAGES       1024
+
+/* Called with the iothread lock held */
+static uint64_t dump_live_sync_dirty(DumpState *s)
+{
+    GuestPhysBlock *block;
+    ram_addr_t ram_addr;
+    uint64_t num_dirty = 0;
+
+    memory_global_dirty_log_sync();
+
+    rcu_read_lock();
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        ram_addr = qemu_ram_addr_from_host(block->host_addr);
+        if (ram_addr == RAM_ADDR_INVALID) {
+            continue;
+        }
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(s->live_bitmap,
+                                ram_addr,
+                                block->target_end - block->target_start);
+    }
+    rcu_read_unlock();
+
+    return num_dirty;
+}
+
+/* Called with the iothread lock held and the guest stopped */
+static void dump_live_start(DumpState *s)
+{
+    error_setg(&s->live_blocker, "A live guest memory dump is in progress");
+    migrate_add_blocker(s->live_blocker);
+
+    s->live_bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    memory_global_dirty_log_start();
+
+    /* Discard what was dirtied before the dump: the first pass copies
+     * everything anyway, later passes only what changed after it began.
+     */
+    dump_live_sync_dirty(s);
+    bitmap_zero(s->live_bitmap, last_ram_offset() >> TARGET_PAGE_BITS);
+}
+
+/* Compute which part of @block is stored in the vmcore */
+static bool dump_get_block_range(DumpState *s, GuestPhysBlock *block,
+                                 int64_t *start, int64_t *size)
+{
+    *start = 0;
+    *size = block->target_end - block->target_start;
+
+    if (s->has_filter) {
+        if (block->target_start >= s->begin + s->length ||
+            block->target_end <= s->begin) {
+            return false;
+        }
+        if (s->begin > block->target_start) {
+            *start = s->begin - block->target_start;
+        }
+        *size -= *start;
+        if (s->begin + s->length < block->target_end) {
+            *size -= block->target_end - (s->begin + s->length);
+        }
+    }
+
+    return true;
+}
+
+static int dump_pwrite(DumpState *s, off_t offset, const void *buf,
+                       size_t size)
+{
+    if (lseek(s->fd, offset, SEEK_SET) != offset) {
+        return -1;
+    }
+    return fd_write_vmcore(buf, size, s);
+}
+
+/* Copy every page set in s->live_bitmap to its place in the vmcore */
+static void dump_live_copy_dirty(DumpState *s, Error **errp)
+{
+    GuestPhysBlock *block;
+    hwaddr offset = s->memory_offset;
+    ram_addr_t base, lo, hi;
+    unsigned long page, end;
+    int64_t start, size;
+
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        if (!dump_get_block_range(s, block, &start, &size)) {
+            continue;
+        }
+
+        base = qemu_ram_addr_from_host(block->host_addr);
+        if (base == RAM_ADDR_INVALID || size == 0) {
+            offset += size;
+            continue;
+        }
+
+        base += start;
+        end = (base + size - 1) >> TARGET_PAGE_BITS;
+        for (page = find_next_bit(s->live_bitmap, end + 1,
+                                  base >> TARGET_PAGE_BITS);
+             page <= end;
+             page = find_next_bit(s->live_bitmap, end + 1, page + 1)) {
+            clear_bit(page, s->live_bitmap);
+
+            lo = MAX((ram_addr_t)page << TARGET_PAGE_BITS, base);
+            hi = MIN((ram_addr_t)(page + 1) << TARGET_PAGE_BITS, base + size);
+            if (dump_pwrite(s, offset + (lo - base),
+                            block->host_addr + start + (lo - base),
+                            hi - lo) < 0) {
+                error_setg(errp, "dump: failed to save memory");
+                return;
+            }
+        }
+
+        offset += size;
+    }
+}
+
+/*
+ * Pause the guest, copy what is still dirty and write the headers.
+ * Called with the iothread lock held.
+ */
+static void dump_live_complete(DumpState *s, Error **errp)
+{
+    Error *local_err = NULL;
+    CPUState *cpu;
+    uint32_t nr_cpus = 0;
+
+    dump_live_sync_dirty(s);
+    dump_live_copy_dirty(s, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    cpu_synchronize_all_states();
+    CPU_FOREACH(cpu) {
+        nr_cpus++;
+    }
+    if (nr_cpus != s->nr_cpus) {
+        error_setg(errp, "dump: CPUs were hot-plugged during the live dump");
+        return;
+    }
+
+    if (lseek(s->fd, 0, SEEK_SET) != 0) {
+        error_setg(errp, "dump: failed to seek to the ELF header");
+        return;
+    }
+    dump_begin(s, errp);
+}
+
+static void create_live_vmcore(DumpState *s, Error **errp)
+{
+    Error *local_err = NULL;
+    uint64_t num_dirty;
+    bool running;
+    int pass;
+
+    /* first pass: copy all of guest memory while the guest runs */
+    if (lseek(s->fd, s->memory_offset, SEEK_SET) != s->memory_offset) {
+        error_setg(&local_err, "dump: failed to seek to guest memory");
+        goto out;
+    }
+    dump_iterate(s, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    /* copy again what the guest dirtied until the remainder is small */
+    for (pass = 0; pass < DUMP_LIVE_MAX_PASSES; pass++) {
+        qemu_mutex_lock_iothread();
+        num_dirty = dump_live_sync_dirty(s);
+        qemu_mutex_unlock_iothread();
+
+        if (num_dirty <= DUMP_LIVE_FINAL_PAGES) {
+            break;
+        }
+        dump_live_copy_dirty(s, &local_err);
+        if (local_err) {
+            goto out;
+        }
+    }
+
+out:
+    qemu_mutex_lock_iothread();
+    running = runstate_is_running();
+    if (running) {
+        vm_stop(RUN_STATE_SAVE_VM);
+    }
+    if (!local_err) {
+        dump_live_complete(s, &local_err);
+    }
+
+    memory_global_dirty_log_stop();
+    g_free(s->live_bitmap);
+    s->live_bitmap = NULL;
+    migrate_del_blocker(s->live_blocker);
+    error_free(s->live_blocker);
+    s->live_blocker = NULL;
+
+    if (running) {
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+
+    error_propagate(errp, local_err);
+}
+
 static int write_start_flat_header(int fd)
 {
     MakedumpfileHeader *mh;
@@ -1181,20 +1402,296 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * Compressing the pages of a kdump-compressed vmcore is by far the most
+ * expensive part of the dump, so it is done by a pool of worker threads.
+ * The dump thread hands out batches of consecutive pages, the workers
+ * compress them concurrently and the dump thread writes the results back
+ * in pfn order, so the layout of the vmcore is the same as if all pages
+ * had been compressed inline.
+ */
+#define DUMP_COMPRESS_BATCH_PAGES 64
+#define DUMP_MAX_COMPRESS_THREADS 255
+
+typedef enum DumpBatchState {
+    DUMP_BATCH_FREE,        /* owned by the dump thread */
+    DUMP_BATCH_PENDING,     /* queued for (or being) compressed */
+    DUMP_BATCH_DONE,        /* compressed, waiting to be written */
+} DumpBatchState;
+
+typedef struct DumpPage {
+    uint8_t *buf;           /* guest page */
+    bool zero;              /* page is all zero */
+    bool zero_known;        /* zero was already set by the dump thread */
+    uint32_t flags;         /* DUMP_DH_COMPRESSED_* or 0 for plaintext */
+    size_t size;            /* number of bytes at data */
+    const uint8_t *data;    /* compressed data, or buf if plaintext */
+} DumpPage;
+
+typedef struct DumpBatch {
+    DumpBatchState state;
+    int nr_pages;
+    DumpPage pages[DUMP_COMPRESS_BATCH_PAGES];
+    uint8_t *buf_out;       /* DUMP_COMPRESS_BATCH_PAGES * len_buf_out */
+} DumpBatch;
+
+typedef struct DumpCompressPool {
+    DumpState *s;
+    size_t len_buf_out;
+
+    QemuMutex lock;
+    QemuCond work_cond;     /* a batch was queued, or quit was set */
+    QemuCond done_cond;     /* a batch was compressed */
+
+    /* batches are used as a ring indexed by sequence number */
+    DumpBatch *batches;
+    unsigned int nr_batches;
+    uint64_t next_submit;   /* sequence number of the next batch to queue */
+    uint64_t next_compress; /* sequence number of the next batch to pick */
+    bool quit;
+
+    unsigned int nr_threads;
+    QemuThread *threads;
+
+    /* pages from zero_next on are known to be zero */
+    uint8_t *zero_next;
+    unsigned long zero_run;
+} DumpCompressPool;
+
+static void dump_compress_page(DumpState *s, DumpPage *page, uint8_t *buf_out,
+                               size_t len_buf_out, void *wrkmem)
+{
+    size_t page_size = s->dump_info.page_size;
+    size_t size_out = len_buf_out;
+
+    if (!page->zero_known) {
+        page->zero = is_zero_page(page->buf, page_size);
+    }
+    if (page->zero) {
+        return;
+    }
+
+    /*
+     * only one compression format will be used here, for s->flag_compress
+     * is set. But when compression fails to work, we fall back to save in
+     * plaintext.
+     */
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+            (compress2(buf_out, (uLongf *)&size_out, page->buf,
+                       page_size, Z_BEST_SPEED) == Z_OK) &&
+            (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_ZLIB;
+#ifdef CONFIG_LZO
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+            (lzo1x_1_compress(page->buf, page_size, buf_out,
+                              (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
+            (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_LZO;
+#endif
+#ifdef CONFIG_SNAPPY
+    } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+            (snappy_compress((char *)page->buf, page_size,
+                             (char *)buf_out, &size_out) == SNAPPY_OK) &&
+            (size_out < page_size)) {
+        page->flags = DUMP_DH_COMPRESSED_SNAPPY;
+#endif
+    } else {
+        page->flags = 0;
+        page->size = page_size;
+        page->data = page->buf;
+        return;
+    }
+
+    page->size = size_out;
+    page->data = buf_out;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressPool *pool = opaque;
+    DumpBatch *batch;
+    void *wrkmem = NULL;
+    int i;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->next_compress == pool->next_submit) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        batch = &pool->batches[pool->next_compress++ % pool->nr_batches];
+        qemu_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < batch->nr_pages; i++) {
+            dump_compress_page(pool->s, &batch->pages[i],
+                               batch->buf_out + i * pool->len_buf_out,
+                               pool->len_buf_out, wrkmem);
+        }
+
+        qemu_mutex_lock(&pool->lock);
+        batch->state = DUMP_BATCH_DONE;
+        qemu_cond_broadcast(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static void dump_compress_pool_init(DumpCompressPool *pool, DumpState *s)
+{
+    unsigned int i;
+
+    pool->s = s;
+    pool->zero_run = 0;
+    pool->len_buf_out = get_len_buf_out(s->dump_info.page_size,
+                                        s->flag_compress);
+    assert(pool->len_buf_out != 0);
+
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    /* two batches per worker keep everybody busy while one is written */
+    pool->nr_threads = s->compress_threads;
+    pool->nr_batches = pool->nr_threads * 2;
+    pool->batches = g_new0(DumpBatch, pool->nr_batches);
+    for (i = 0; i < pool->nr_batches; i++) {
+        pool->batches[i].buf_out = g_malloc(DUMP_COMPRESS_BATCH_PAGES *
+                                            pool->len_buf_out);
+    }
+    pool->next_submit = 0;
+    pool->next_compress = 0;
+    pool->quit = false;
+
+    pool->threads = g_new0(QemuThread, pool->nr_threads);
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_create(&pool->threads[i], "dump_compress",
+                           dump_compress_thread, pool,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_pool_cleanup(DumpCompressPool *pool)
+{
+    unsigned int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nr_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    g_free(pool->threads);
+
+    for (i = 0; i < pool->nr_batches; i++) {
+        g_free(pool->batches[i].buf_out);
+    }
+    g_free(pool->batches);
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Look @page up in the zero-range map of its RAMBlock.  A lookup covers the
+ * rest of the batch at once, and the pages that follow contiguously in host
+ * memory are then answered from the run.  Pages the map does not know about
+ * are left for the compression threads to check.
+ */
+static void dump_lookup_zero(DumpCompressPool *pool, DumpPage *page,
+                             unsigned long remaining)
+{
+    RAMBlock *rb;
+    ram_addr_t offset;
+
+    page->zero_known = false;
+    if (!pool->s->zero_map_synced ||
+        pool->s->dump_info.page_size != TARGET_PAGE_SIZE) {
+        return;
+    }
+
+    if (pool->zero_run && page->buf == pool->zero_next) {
+        pool->zero_run--;
+        pool->zero_next += TARGET_PAGE_SIZE;
+        page->zero = page->zero_known = true;
+        return;
+    }
+
+    rb = qemu_ram_block_from_host(page->buf, false, &offset);
+    if (!rb) {
+        pool->zero_run = 0;
+        return;
+    }
+    pool->zero_run = ram_block_known_zero_pages(rb, offset, remaining);
+    pool->zero_next = page->buf;
+    if (pool->zero_run) {
+        page->zero = page->zero_known = true;
+        pool->zero_run--;
+        pool->zero_next += TARGET_PAGE_SIZE;
+    }
+}
+
+/*
+ * Fill the next free batch with up to DUMP_COMPRESS_BATCH_PAGES pages and
+ * queue it for compression.  Returns false once all pages have been queued.
+ */
+static bool dump_compress_submit(DumpCompressPool *pool,
+                                 GuestPhysBlock **block_iter,
+                                 uint64_t *pfn_iter)
+{
+    DumpBatch *batch = &pool->batches[pool->next_submit % pool->nr_batches];
+    bool more = true;
+    uint8_t *buf;
+
+    assert(batch->state == DUMP_BATCH_FREE);
+    batch->nr_pages = 0;
+    while (batch->nr_pages < DUMP_COMPRESS_BATCH_PAGES) {
+        more = get_next_page(block_iter, pfn_iter, &buf, pool->s);
+        if (!more) {
+            break;
+        }
+        batch->pages[batch->nr_pages].buf = buf;
+        dump_lookup_zero(pool, &batch->pages[batch->nr_pages],
+                         DUMP_COMPRESS_BATCH_PAGES - batch->nr_pages);
+        batch->nr_pages++;
+    }
+
+    if (batch->nr_pages) {
+        qemu_mutex_lock(&pool->lock);
+        batch->state = DUMP_BATCH_PENDING;
+        pool->next_submit++;
+        qemu_cond_signal(&pool->work_cond);
+        qemu_mutex_unlock(&pool->lock);
+    }
+
+    return more;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpCompressPool pool;
+    DumpBatch *batch;
+    DumpPage *page;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    uint64_t next_write = 0;
+    bool more = true;
+    int i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1203,15 +1700,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     prepare_data_cache(&page_desc, s, offset_desc);
     prepare_data_cache(&page_data, s, offset_data);
 
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
-    assert(len_buf_out != 0);
-
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    dump_compress_pool_init(&pool, s);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1235,97 +1724,58 @@ static void write_dump_pages(DumpState *s, Error **errp)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
+    for (;;) {
+        /* keep every free batch queued for compression */
+        while (more && pool.next_submit - next_write < pool.nr_batches) {
+            more = dump_compress_submit(&pool, &block_iter, &pfn_iter);
+        }
+        if (next_write == pool.next_submit) {
+            break;
+        }
+
+        /* write back the oldest batch, so that pages stay in pfn order */
+        batch = &pool.batches[next_write % pool.nr_batches];
+        qemu_mutex_lock(&pool.lock);
+        while (batch->state != DUMP_BATCH_DONE) {
+            qemu_cond_wait(&pool.done_cond, &pool.lock);
+        }
+        qemu_mutex_unlock(&pool.lock);
+
+        for (i = 0; i < batch->nr_pages; i++) {
+            page = &batch->pages[i];
+            if (page->zero) {
+                ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
+                                  false);
                 if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
+                    error_setg(errp, "dump: failed to write page desc");
                     goto out;
                 }
-#endif
             } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
+                ret = write_cache(&page_data, page->data, page->size, false);
                 if (ret < 0) {
                     error_setg(errp, "dump: failed to write page data");
                     goto out;
                 }
-            }
 
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+                /* get and write page desc here */
+                pd.flags = cpu_to_dump32(s, page->flags);
+                pd.size = cpu_to_dump32(s, page->size);
+                pd.page_flags = cpu_to_dump64(s, 0);
+                pd.offset = cpu_to_dump64(s, offset_data);
+                offset_data += page->size;
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+                ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor),
+                                  false);
+                if (ret < 0) {
+                    error_setg(errp, "dump: failed to write page desc");
+                    goto out;
+                }
             }
+            s->written_size += s->dump_info.page_size;
         }
-        s->written_size += s->dump_info.page_size;
+
+        batch->state = DUMP_BATCH_FREE;
+        next_write++;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1340,14 +1790,9 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
 out:
+    dump_compress_pool_cleanup(&pool);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1507,6 +1952,16 @@ static void dump_init(DumpState *s, int fd, bool has_format,
         s->resume = false;
     }
 
+    /* The zero map of RAM is only up to date once the writes done before
+     * the VM stopped have been harvested.
+     */
+    s->zero_map_synced = false;
+    if (has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF &&
+        ram_list.zero_map) {
+        memory_global_dirty_log_sync();
+        s->zero_map_synced = true;
+    }
+
     /* If we use KVM, we should synchronize the registers before we get dump
      * info or physmap info.
      */
@@ -1663,7 +2118,9 @@ static void dump_process(DumpState *s, Error **errp)
     Error *local_err = NULL;
     DumpQueryResult *result = NULL;
 
-    if (s->has_format && s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+    if (s->live) {
+        create_live_vmcore(s, &local_err);
+    } else if (s->has_format && s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
         create_kdump_vmcore(s, &local_err);
     } else {
         create_vmcore(s, &local_err);
@@ -1691,8 +2148,11 @@ static void *dump_thread(void *data)
 {
     Error *err = NULL;
     DumpState *s = (DumpState *)data;
+
+    rcu_register_thread();
     dump_process(s, &err);
     error_free(err);
+    rcu_unregister_thread();
     return NULL;
 }
 
@@ -1712,7 +2172,9 @@ void qmp_dump_guest_memory(bool paging, const char *file,
                            bool has_detach, bool detach,
                            bool has_begin, int64_t begin, bool has_length,
                            int64_t length, bool has_format,
-                           DumpGuestMemoryFormat format, Error **errp)
+                           DumpGuestMemoryFormat format, bool has_threads,
+                           int64_t threads, bool has_live, bool live,
+                           Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -1750,9 +2212,46 @@ void qmp_dump_guest_memory(bool paging, const char *file,
         error_setg(errp, QERR_MISSING_PARAMETER, "begin");
         return;
     }
+    if (has_threads) {
+        if (!has_format || format == DUMP_GUEST_MEMORY_FORMAT_ELF) {
+            error_setg(errp, "'threads' is only supported with "
+                             "kdump-compressed formats");
+            return;
+        }
+        if (threads < 1 || threads > DUMP_MAX_COMPRESS_THREADS) {
+            error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                       "an integer in the range of 1 to "
+                       stringify(DUMP_MAX_COMPRESS_THREADS));
+            return;
+        }
+    } else {
+        threads = 1;
+    }
     if (has_detach) {
         detach_p = detach;
     }
+    if (!has_live) {
+        live = false;
+    }
+    if (live) {
+        if (!detach_p) {
+            error_setg(errp, "live dump requires 'detach'");
+            return;
+        }
+        if (paging || (has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF)) {
+            error_setg(errp, "live dump only supports the ELF format "
+                             "without paging");
+            return;
+        }
+        if (!migration_is_idle()) {
+            error_setg(errp, "live dump not allowed during migration");
+            return;
+        }
+        if (fast_snapshot_active()) {
+            error_setg(errp, "live dump not allowed with a fast snapshot");
+            return;
+        }
+    }
 
     /* check whether lzo/snappy is supported */
 #ifndef CONFIG_LZO
@@ -1791,8 +2290,16 @@ void qmp_dump_guest_memory(bool paging, const char *file,
         return;
     }
 
+    if (live && lseek(fd, 0, SEEK_CUR) < 0) {
+        error_setg(errp, "live dump requires a seekable file");
+        close(fd);
+        return;
+    }
+
     s = &dump_state_global;
     dump_state_prepare(s);
+    s->compress_threads = threads;
+    s->live = live;
 
     dump_init(s, fd, has_format, format, paging, has_begin,
               begin, length, &local_err);
@@ -1802,6 +2309,15 @@ void qmp_dump_guest_memory(bool paging, const char *file,
         return;
     }
 
+    if (live) {
+        /* the guest keeps running while memory is copied */
+        dump_live_start(s);
+        if (s->resume) {
+            s->resume = false;
+            vm_start();
+        }
+    }
+
     if (detach_p) {
         /* detached dump */
         qemu_thread_create(&s->dump_thread, "dump_thread", dump_thread,
@@ -1419,6 +1419,156 @@ ram_addr_t last_ram_offset(void)
     return last;
 }
 
+/* Called with the iothread lock held, when dirty logging starts */
+void ram_zero_map_start(void)
+{
+    RAMZeroMap *zm;
+    unsigned long pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    if (ram_list.zero_map) {
+        return;
+    }
+    zm = g_malloc0(sizeof(*zm) + BITS_TO_LONGS(pages) * sizeof(unsigned long));
+    zm->pages = pages;
+    atomic_rcu_set(&ram_list.zero_map, zm);
+}
+
+/* Called with the iothread lock held, when dirty logging stops */
+void ram_zero_map_stop(void)
+{
+    RAMZeroMap *zm = ram_list.zero_map;
+
+    if (zm) {
+        atomic_rcu_set(&ram_list.zero_map, NULL);
+        g_free_rcu(zm, rcu);
+    }
+}
+
+/* Forget what is known about [start, start + length) */
+void ram_zero_map_clear(ram_addr_t start, ram_addr_t length)
+{
+    RAMZeroMap *zm;
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    unsigned long last = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+
+    rcu_read_lock();
+    zm = atomic_rcu_read(&ram_list.zero_map);
+    if (zm && first < zm->pages) {
+        bitmap_test_and_clear_atomic(zm->map, first,
+                                     MIN(last, zm->pages) - first);
+    }
+    rcu_read_unlock();
+}
+
+/* Pages scanned with a single buffer_is_zero() call before falling back to
+ * one call per page; a wide scan amortizes the call and lets the vector
+ * loop run without interruption over long zero runs.
+ */
+#define ZERO_SCAN_PAGES 64
+
+static unsigned long ram_block_zero_run(RAMBlock *rb, ram_addr_t offset,
+                                        unsigned long max_pages, bool scan)
+{
+    RAMZeroMap *zm;
+    unsigned long first, page, n, zero = 0;
+    unsigned gen = 0;
+
+    offset &= TARGET_PAGE_MASK;
+    if (offset >= rb->used_length) {
+        return 0;
+    }
+    max_pages = MIN(max_pages, (rb->used_length - offset) >> TARGET_PAGE_BITS);
+    first = (rb->offset + offset) >> TARGET_PAGE_BITS;
+
+    rcu_read_lock();
+    zm = atomic_rcu_read(&ram_list.zero_map);
+    if (zm) {
+        gen = atomic_read(&ram_list.zero_map_gen);
+        smp_rmb();
+        if ((gen & 1) || first + max_pages > zm->pages) {
+            zm = NULL;
+        }
+    }
+
+    /* Known zero pages that have not been written since they were scanned */
+    if (zm) {
+        while (zero < max_pages && test_bit(first + zero, zm->map) &&
+               !cpu_physical_memory_get_dirty((first + zero) << TARGET_PAGE_BITS,
+                                              TARGET_PAGE_SIZE,
+                                              DIRTY_MEMORY_MIGRATION)) {
+            zero++;
+        }
+        smp_rmb();
+        if (atomic_read(&ram_list.zero_map_gen) != gen) {
+            zero = 0;
+            zm = NULL;
+        }
+        if (zero == max_pages || !scan) {
+            goto out;
+        }
+    } else if (!scan) {
+        goto out;
+    }
+
+    page = zero;
+    n = MIN(max_pages - page, ZERO_SCAN_PAGES);
+    if (n > 1 && buffer_is_zero(ramblock_ptr(rb, offset +
+                                             (page << TARGET_PAGE_BITS)),
+                                n << TARGET_PAGE_BITS)) {
+        zero += n;
+    } else {
+        while (zero < page + n &&
+               buffer_is_zero(ramblock_ptr(rb, offset +
+                                           (zero << TARGET_PAGE_BITS)),
+                              TARGET_PAGE_SIZE)) {
+            zero++;
+        }
+    }
+
+    if (zm && zero > page) {
+        bitmap_set_atomic(zm->map, first + page, zero - page);
+        /* A harvest that ran during the scan may have missed these bits */
+        smp_mb();
+        if (atomic_read(&ram_list.zero_map_gen) != gen) {
+            bitmap_test_and_clear_atomic(zm->map, first + page, zero - page);
+        }
+    }
+
+out:
+    rcu_read_unlock();
+    return zero;
+}
+
+/* Return how many consecutive pages starting at @offset in @rb are zero,
+ * up to @max_pages.  Pages that are scanned while dirty logging is on are
+ * remembered, so that later callers (the next migration pass, a dump) do
+ * not read them again until the guest writes to them.
+ *
+ * Only the first page is guaranteed to be looked at; the result may stop
+ * short of the real run.
+ *
+ * A remembered page is trusted until its DIRTY_MEMORY_MIGRATION bit is set,
+ * but under KVM that bit only follows guest writes after
+ * memory_global_dirty_log_sync().  The migration iteration syncs on its own;
+ * any other caller must sync with the iothread lock held, and keep the guest
+ * from running, before it relies on the result.
+ */
+unsigned long ram_block_zero_pages(RAMBlock *rb, ram_addr_t offset,
+                                   unsigned long max_pages)
+{
+    return ram_block_zero_run(rb, offset, max_pages, true);
+}
+
+/* Like ram_block_zero_pages(), but only answer from the pages remembered
+ * while dirty logging is on; no memory is read.  The same rule about
+ * syncing the dirty log applies.
+ */
+unsigned long ram_block_known_zero_pages(RAMBlock *rb, ram_addr_t offset,
+                                         unsigned long max_pages)
+{
+    return ram_block_zero_run(rb, offset, max_pages, false);
+}
+
 static void qemu_ram_setup_dump(void *addr, ram_addr_t size)
 {
     int ret;
@@ -1439,6 +1589,21 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+int qemu_ram_get_fd(RAMBlock *rb)
+{
+    return rb->fd;
+}
+
+bool qemu_ram_is_shared(RAMBlock *rb)
+{
+    return rb->flags & RAM_SHARED;
+}
+
+ram_addr_t qemu_ram_get_used_length(RAMBlock *rb)
+{
+    return rb->used_length;
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
@@ -1645,6 +1810,7 @@ static void ram_block_add(RAMBlock *new_block, Error **errp)
     ram_list.version++;
     qemu_mutex_unlock_ramlist();
 
+    ram_zero_map_clear(new_block->offset, new_block->max_length);
     cpu_physical_memory_set_dirty_range(new_block->offset,
                                         new_block->used_length,
                                         DIRTY_CLIENTS_ALL);
@@ -1787,6 +1953,7 @@ void qemu_ram_free(RAMBlock *block)
     qemu_mutex_lock_ramlist();
     QLIST_REMOVE_RCU(block, next);
     ram_list.mru_block = NULL;
+    ram_zero_map_clear(block->offset, block->max_length);
     /* Write list before version */
     smp_wmb();
     ram_list.version++;
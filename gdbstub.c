@@ -29,7 +29,11 @@
 #include "exec/gdbstub.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+/* Largest packet we accept and send, advertised to gdb as PacketSize.
+ * gdb sizes its memory reads after it, so a large value keeps bulk
+ * memory transfers from being split into many round trips.
+ */
+#define MAX_PACKET_LENGTH 0x20000
 
 #include "qemu/sockets.h"
 #include "sysemu/kvm.h"
@@ -297,6 +301,9 @@ typedef struct GDBState {
     int line_csum;
     uint8_t last_packet[MAX_PACKET_LENGTH + 4];
     int last_packet_len;
+    /* scratch buffers for gdb_handle_packet, too large for the stack */
+    char str_buf[MAX_PACKET_LENGTH];
+    uint8_t mem_buf[MAX_PACKET_LENGTH];
     int signal;
 #ifdef CONFIG_USER_ONLY
     int fd;
@@ -450,26 +457,84 @@ static void hextomem(uint8_t *mem, const char *buf, int len)
     }
 }
 
+/*
+ * Replies are built in place in s->last_packet, which is also what gets
+ * retransmitted on a NACK, so large replies are never staged elsewhere.
+ */
+static void gdb_packet_start(GDBState *s)
+{
+    s->last_packet[0] = '$';
+    s->last_packet_len = 1;
+}
+
+/* Number of payload bytes that still fit, keeping room for "#xx" */
+static int gdb_packet_room(GDBState *s)
+{
+    return sizeof(s->last_packet) - 3 - s->last_packet_len;
+}
+
+static void gdb_packet_append(GDBState *s, const void *buf, int len)
+{
+    assert(len <= gdb_packet_room(s));
+    memcpy(s->last_packet + s->last_packet_len, buf, len);
+    s->last_packet_len += len;
+}
+
+static void gdb_packet_append_hex(GDBState *s, const uint8_t *mem, int len)
+{
+    assert(len * 2 <= gdb_packet_room(s));
+    /* the trailing NUL written by memtohex is overwritten by '#' */
+    memtohex((char *)s->last_packet + s->last_packet_len, mem, len);
+    s->last_packet_len += len * 2;
+}
+
+/* Append @mem using the encoding for binary data.  Returns the number of
+ * bytes of @mem that fit into the packet.
+ */
+static int gdb_packet_append_binary(GDBState *s, const uint8_t *mem, int len)
+{
+    uint8_t *p = s->last_packet + s->last_packet_len;
+    uint8_t *end = p + gdb_packet_room(s);
+    int i;
+
+    for (i = 0; i < len; i++) {
+        switch (mem[i]) {
+        case '#': case '$': case '*': case '}':
+            if (end - p < 2) {
+                goto full;
+            }
+            *(p++) = '}';
+            *(p++) = mem[i] ^ 0x20;
+            break;
+        default:
+            if (end - p < 1) {
+                goto full;
+            }
+            *(p++) = mem[i];
+            break;
+        }
+    }
+full:
+    s->last_packet_len = p - s->last_packet;
+    return i;
+}
+
 /* return -1 if error, 0 if OK */
-static int put_packet_binary(GDBState *s, const char *buf, int len)
+static int gdb_packet_finish(GDBState *s)
 {
     int csum, i;
-    uint8_t *p;
+    uint8_t *p = s->last_packet + s->last_packet_len;
 
-    for(;;) {
-        p = s->last_packet;
-        *(p++) = '$';
-        memcpy(p, buf, len);
-        p += len;
-        csum = 0;
-        for(i = 0; i < len; i++) {
-            csum += buf[i];
-        }
-        *(p++) = '#';
-        *(p++) = tohex((csum >> 4) & 0xf);
-        *(p++) = tohex((csum) & 0xf);
+    csum = 0;
+    for (i = 1; i < s->last_packet_len; i++) {
+        csum += s->last_packet[i];
+    }
+    *(p++) = '#';
+    *(p++) = tohex((csum >> 4) & 0xf);
+    *(p++) = tohex((csum) & 0xf);
+    s->last_packet_len = p - s->last_packet;
 
-        s->last_packet_len = p - s->last_packet;
+    for(;;) {
         put_buffer(s, (uint8_t *)s->last_packet, s->last_packet_len);
 
 #ifdef CONFIG_USER_ONLY
@@ -485,6 +550,14 @@ static int put_packet_binary(GDBState *s, const char *buf, int len)
     return 0;
 }
 
+/* return -1 if error, 0 if OK */
+static int put_packet_binary(GDBState *s, const char *buf, int len)
+{
+    gdb_packet_start(s);
+    gdb_packet_append(s, buf, len);
+    return gdb_packet_finish(s);
+}
+
 /* return -1 if error, 0 if OK */
 static int put_packet(GDBState *s, const char *buf)
 {
@@ -790,8 +863,8 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
     const char *p;
     uint32_t thread;
     int ch, reg_size, type, res;
-    char buf[MAX_PACKET_LENGTH];
-    uint8_t mem_buf[MAX_PACKET_LENGTH];
+    char *buf = s->str_buf;
+    uint8_t *mem_buf = s->mem_buf;
     uint8_t *registers;
     target_ulong addr, len;
 
@@ -803,7 +876,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
     switch(ch) {
     case '?':
         /* TODO: Make this return the correct value for user-mode.  */
-        snprintf(buf, sizeof(buf), "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
+        snprintf(buf, MAX_PACKET_LENGTH, "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
                  cpu_index(s->c_cpu));
         put_packet(s, buf);
         /* Remove all the breakpoints when this query is issued,
@@ -969,8 +1042,44 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, false) != 0) {
             put_packet (s, "E14");
         } else {
-            memtohex(buf, mem_buf, len);
-            put_packet(s, buf);
+            gdb_packet_start(s);
+            gdb_packet_append_hex(s, mem_buf, len);
+            gdb_packet_finish(s);
+        }
+        break;
+    case 'x':
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, NULL, 16);
+
+        /* The reply may be shorter than requested, so read page by page
+         * straight into the packet and stop at the first unreadable page
+         * or when the packet is full.
+         */
+        gdb_packet_start(s);
+        gdb_packet_append(s, "b", 1);
+        while (len > 0) {
+            target_ulong chunk = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+            int done;
+
+            chunk = MIN(chunk, len);
+            if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, chunk,
+                                       false) != 0) {
+                break;
+            }
+            done = gdb_packet_append_binary(s, mem_buf, chunk);
+            addr += done;
+            len -= done;
+            if (done < chunk) {
+                break;
+            }
+        }
+        if (s->last_packet_len == 2 && len > 0) {
+            /* nothing could be read at all */
+            put_packet(s, "E14");
+        } else {
+            gdb_packet_finish(s);
         }
         break;
     case 'M':
@@ -1081,7 +1190,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         /* parse any 'q' packets here */
         if (!strcmp(p,"qemu.sstepbits")) {
             /* Query Breakpoint bit definitions */
-            snprintf(buf, sizeof(buf), "ENABLE=%x,NOIRQ=%x,NOTIMER=%x",
+            snprintf(buf, MAX_PACKET_LENGTH, "ENABLE=%x,NOIRQ=%x,NOTIMER=%x",
                      SSTEP_ENABLE,
                      SSTEP_NOIRQ,
                      SSTEP_NOTIMER);
@@ -1092,7 +1201,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p += 10;
             if (*p != '=') {
                 /* Display current setting */
-                snprintf(buf, sizeof(buf), "0x%x", sstep_flags);
+                snprintf(buf, MAX_PACKET_LENGTH, "0x%x", sstep_flags);
                 put_packet(s, buf);
                 break;
             }
@@ -1112,7 +1221,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         } else if (strcmp(p,"sThreadInfo") == 0) {
         report_cpuinfo:
             if (s->query_cpu) {
-                snprintf(buf, sizeof(buf), "m%x", cpu_index(s->query_cpu));
+                snprintf(buf, MAX_PACKET_LENGTH, "m%x", cpu_index(s->query_cpu));
                 put_packet(s, buf);
                 s->query_cpu = CPU_NEXT(s->query_cpu);
             } else
@@ -1124,7 +1233,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             if (cpu != NULL) {
                 cpu_synchronize_state(cpu);
                 /* memtohex() doubles the required space */
-                len = snprintf((char *)mem_buf, sizeof(buf) / 2,
+                len = snprintf((char *)mem_buf, MAX_PACKET_LENGTH / 2,
                                "CPU#%d [%s]", cpu->cpu_index,
                                cpu->halted ? "halted " : "running");
                 memtohex(buf, mem_buf, len);
@@ -1136,7 +1245,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         else if (strcmp(p, "Offsets") == 0) {
             TaskState *ts = s->c_cpu->opaque;
 
-            snprintf(buf, sizeof(buf),
+            snprintf(buf, MAX_PACKET_LENGTH,
                      "Text=" TARGET_ABI_FMT_lx ";Data=" TARGET_ABI_FMT_lx
                      ";Bss=" TARGET_ABI_FMT_lx,
                      ts->info->code_offset,
@@ -1162,10 +1271,11 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
 #endif /* !CONFIG_USER_ONLY */
         if (is_query_packet(p, "Supported", ':')) {
-            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
+            snprintf(buf, MAX_PACKET_LENGTH, "PacketSize=%x;binary-upload+",
+                     MAX_PACKET_LENGTH);
             cc = CPU_GET_CLASS(first_cpu);
             if (cc->gdb_core_xml_file != NULL) {
-                pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
+                pstrcat(buf, MAX_PACKET_LENGTH, ";qXfer:features:read+");
             }
             put_packet(s, buf);
             break;
@@ -1183,7 +1293,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p += 19;
             xml = get_feature_xml(p, &p, cc);
             if (!xml) {
-                snprintf(buf, sizeof(buf), "E00");
+                snprintf(buf, MAX_PACKET_LENGTH, "E00");
                 put_packet(s, buf);
                 break;
             }
@@ -1197,7 +1307,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 
             total_len = strlen(xml);
             if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
+                snprintf(buf, MAX_PACKET_LENGTH, "E00");
                 put_packet(s, buf);
                 break;
             }
@@ -1685,15 +1795,18 @@ static void gdb_chr_event(void *opaque, int event)
     }
 }
 
+/* Largest chunk of monitor output that fits into one 'O' packet */
+#define GDB_MONITOR_OUTPUT_MAX ((MAX_PACKET_LENGTH - 2) / 2)
+
 static void gdb_monitor_output(GDBState *s, const char *msg, int len)
 {
-    char buf[MAX_PACKET_LENGTH];
-
-    buf[0] = 'O';
-    if (len > (MAX_PACKET_LENGTH/2) - 1)
-        len = (MAX_PACKET_LENGTH/2) - 1;
-    memtohex(buf + 1, (uint8_t *)msg, len);
-    put_packet(s, buf);
+    if (len > GDB_MONITOR_OUTPUT_MAX) {
+        len = GDB_MONITOR_OUTPUT_MAX;
+    }
+    gdb_packet_start(s);
+    gdb_packet_append(s, "O", 1);
+    gdb_packet_append_hex(s, (const uint8_t *)msg, len);
+    gdb_packet_finish(s);
 }
 
 static int gdb_monitor_write(CharDriverState *chr, const uint8_t *buf, int len)
@@ -1701,7 +1814,7 @@ static int gdb_monitor_write(CharDriverState *chr, const uint8_t *buf, int len)
     const char *p = (const char *)buf;
     int max_sz;
 
-    max_sz = (sizeof(gdbserver_state->last_packet) - 2) / 2;
+    max_sz = GDB_MONITOR_OUTPUT_MAX;
     for (;;) {
         if (len <= max_sz) {
             gdb_monitor_output(gdbserver_state, p, len);
@@ -327,19 +327,27 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "background:-b,name:s?",
+        .params     = "[-b] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -b to save RAM while the guest keeps running",
         .cmd        = hmp_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-b] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-b}, the command returns immediately and guest RAM is
+written while the guest keeps running; the guest is only paused at the
+end, to save the pages it modified in the meantime and the device
+state.  Progress is reported by @code{info migrate}, and
+@code{migrate_cancel} aborts the snapshot.  A snapshot with the same
+tag or ID is only replaced once the new one has been written.
 ETEXI
 
     {
@@ -356,6 +364,50 @@ STEXI
 @findex loadvm
 Set the whole virtual machine to the snapshot identified by the tag
 @var{tag} or the unique snapshot ID @var{id}.
+ETEXI
+
+    {
+        .name       = "fast_snapshot_save",
+        .args_type  = "",
+        .params     = "",
+        .help       = "take an in-memory snapshot of RAM and devices",
+        .cmd        = hmp_fast_snapshot_save,
+    },
+
+STEXI
+@item fast_snapshot_save
+@findex fast_snapshot_save
+Keep a copy of guest RAM and device state in host memory and start
+tracking the pages the guest writes.  Block devices are not included.
+ETEXI
+
+    {
+        .name       = "fast_snapshot_revert",
+        .args_type  = "",
+        .params     = "",
+        .help       = "revert to the in-memory snapshot",
+        .cmd        = hmp_fast_snapshot_revert,
+    },
+
+STEXI
+@item fast_snapshot_revert
+@findex fast_snapshot_revert
+Go back to the state saved by @code{fast_snapshot_save}, restoring only
+the pages written since.
+ETEXI
+
+    {
+        .name       = "fast_snapshot_delete",
+        .args_type  = "",
+        .params     = "",
+        .help       = "discard the in-memory snapshot",
+        .cmd        = hmp_fast_snapshot_delete,
+    },
+
+STEXI
+@item fast_snapshot_delete
+@findex fast_snapshot_delete
+Discard the snapshot taken by @code{fast_snapshot_save}.
 ETEXI
 
     {
@@ -1072,11 +1124,12 @@ ETEXI
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,detach:-d,zlib:-z,lzo:-l,snappy:-s,filename:F,begin:i?,length:i?",
-        .params     = "[-p] [-d] [-z|-l|-s] filename [begin length]",
+        .args_type  = "paging:-p,detach:-d,live:-L,zlib:-z,lzo:-l,snappy:-s,filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-d] [-L] [-z|-l|-s] filename [begin length]",
         .help       = "dump guest memory into file 'filename'.\n\t\t\t"
                       "-p: do paging to get guest's memory mapping.\n\t\t\t"
                       "-d: return immediately (do not wait for completion).\n\t\t\t"
+                      "-L: dump while the guest keeps running (implies -d).\n\t\t\t"
                       "-z: dump in kdump-compressed format, with zlib compression.\n\t\t\t"
                       "-l: dump in kdump-compressed format, with lzo compression.\n\t\t\t"
                       "-s: dump in kdump-compressed format, with snappy compression.\n\t\t\t"
@@ -1088,11 +1141,14 @@ ETEXI
 
 STEXI
 @item dump-guest-memory [-p] @var{filename} @var{begin} @var{length}
+@item dump-guest-memory [-L] @var{filename} @var{begin} @var{length}
 @item dump-guest-memory [-z|-l|-s] @var{filename}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb. Without -z|-l|-s, the dump format is ELF.
         -p: do paging to get guest's memory mapping.
+        -L: copy memory while the guest keeps running, pausing it only
+            for the final pass (ELF only, implies -d).
         -z: dump in kdump-compressed format, with zlib compression.
         -l: dump in kdump-compressed format, with lzo compression.
         -s: dump in kdump-compressed format, with snappy compression.
@@ -240,8 +240,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
@@ -322,6 +326,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
             params->x_checkpoint_delay);
+        assert(params->has_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
         monitor_printf(mon, "\n");
     }
 
@@ -1394,6 +1402,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.has_x_checkpoint_delay = true;
                 use_int_value = true;
                 break;
+            case MIGRATION_PARAMETER_MULTIFD_CHANNELS:
+                p.has_multifd_channels = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1411,6 +1423,7 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                 p.cpu_throttle_increment = valueint;
                 p.downtime_limit = valueint;
                 p.x_checkpoint_delay = valueint;
+                p.multifd_channels = valueint;
             }
 
             qmp_migrate_set_parameters(&p, &err);
@@ -1730,6 +1743,7 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     bool zlib = qdict_get_try_bool(qdict, "zlib", false);
     bool lzo = qdict_get_try_bool(qdict, "lzo", false);
     bool snappy = qdict_get_try_bool(qdict, "snappy", false);
+    bool live = qdict_get_try_bool(qdict, "live", false);
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
@@ -1767,15 +1781,51 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     if (has_detach) {
         detach = qdict_get_bool(qdict, "detach");
     }
+    if (live) {
+        /* a live dump always runs in the background */
+        detach = true;
+    }
 
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, true, detach, has_begin, begin,
-                          has_length, length, true, dump_format, &err);
+                          has_length, length, true, dump_format,
+                          false, 0, true, live, &err);
     hmp_handle_error(mon, &err);
     g_free(prot);
 }
 
+void hmp_fast_snapshot_save(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_fast_snapshot_save(&err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_fast_snapshot_revert(Monitor *mon, const QDict *qdict)
+{
+    FastSnapshotRevertInfo *info;
+    Error *err = NULL;
+
+    info = qmp_fast_snapshot_revert(&err);
+    if (err) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+    monitor_printf(mon, "restored %" PRId64 " pages in %" PRId64 " us\n",
+                   info->dirty_pages, info->duration);
+    qapi_free_FastSnapshotRevertInfo(info);
+}
+
+void hmp_fast_snapshot_delete(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_fast_snapshot_delete(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -2155,8 +2205,19 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        monitor_printf(mon, "%s:\n", info->value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n",
+                       info->value->thread_id);
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n",
+                       info->value->poll_max_ns);
+        monitor_printf(mon, "  poll-grow=%" PRId64 "\n",
+                       info->value->poll_grow);
+        monitor_printf(mon, "  poll-shrink=%" PRId64 "\n",
+                       info->value->poll_shrink);
+        monitor_printf(mon, "  poll-hits=%" PRId64 "\n",
+                       info->value->poll_hits);
+        monitor_printf(mon, "  poll-misses=%" PRId64 "\n",
+                       info->value->poll_misses);
     }
 
     qapi_free_IOThreadInfoList(info_list);
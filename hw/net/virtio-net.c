@@ -1101,7 +1101,11 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Sets *@flushed when the packet reached the used ring; notifying the
+ * guest is left to the caller.
+ */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size, bool *flushed)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1199,11 +1203,51 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    *flushed = true;
 
     return size;
 }
 
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool flushed = false;
+    ssize_t ret;
+
+    ret = virtio_net_do_receive(nc, buf, size, &flushed);
+    if (flushed) {
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+
+    return ret;
+}
+
+/* Same as virtio_net_receive() for each packet, but the guest is only
+ * notified once for the whole batch.
+ */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int npkts)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool flushed = false;
+    int i;
+
+    for (i = 0; i < npkts; i++) {
+        if (virtio_net_do_receive(nc, pkts[i].iov_base, pkts[i].iov_len,
+                                  &flushed) == 0) {
+            break;
+        }
+    }
+
+    if (flushed) {
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1669,6 +1713,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
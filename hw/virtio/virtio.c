@@ -59,6 +59,28 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent {
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A completed element waiting in virtqueue_fill() for virtqueue_flush() on a
+ * packed ring.  The whole batch is published by the flags of its first
+ * element, so nothing can be written to the ring before the flush.
+ */
+typedef struct VRingPackedUsedElem {
+    unsigned int index;
+    unsigned int len;
+    unsigned int ndescs;
+} VRingPackedUsedElem;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -81,6 +103,13 @@ struct VirtQueue
 
     uint16_t used_idx;
 
+    /* Packed ring wrap counters for last_avail_idx and used_idx */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* Packed ring only: elements filled but not flushed yet */
+    VRingPackedUsedElem *used_elems;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -92,6 +121,7 @@ struct VirtQueue
 
     uint16_t queue_index;
 
+    /* Elements popped and not yet pushed; ring slots on a packed ring */
     int inuse;
 
     uint16_t vector;
@@ -208,10 +238,112 @@ static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
     virtio_stw_phys(vq->vdev, pa, val);
 }
 
+static void vring_packed_desc_read_flags(VirtIODevice *vdev, uint16_t *flags,
+                                        hwaddr desc_pa, int i)
+{
+    *flags = virtio_lduw_phys(vdev, desc_pa + i * sizeof(VRingPackedDesc) +
+                                    offsetof(VRingPackedDesc, flags));
+}
+
+/* The caller must have seen the descriptor's flags mark it available
+ * before reading the rest of it.
+ */
+static void vring_packed_desc_read(VirtIODevice *vdev, VRingPackedDesc *desc,
+                                   hwaddr desc_pa, int i)
+{
+    address_space_read(&address_space_memory,
+                       desc_pa + i * sizeof(VRingPackedDesc),
+                       MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                       sizeof(VRingPackedDesc));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+static void vring_packed_used_write(VirtQueue *vq,
+                                    const VRingPackedUsedElem *uelem,
+                                    unsigned int head, bool wrap,
+                                    bool strict_order)
+{
+    VirtIODevice *vdev = vq->vdev;
+    hwaddr pa = vq->vring.desc + head * sizeof(VRingPackedDesc);
+    uint16_t flags = 0;
+
+    if (wrap) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+    if (uelem->len) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+
+    virtio_stw_phys(vdev, pa + offsetof(VRingPackedDesc, id), uelem->index);
+    virtio_stl_phys(vdev, pa + offsetof(VRingPackedDesc, len), uelem->len);
+    if (strict_order) {
+        /* Make sure id and len are written before flags. */
+        smp_wmb();
+    }
+    virtio_stw_phys(vdev, pa + offsetof(VRingPackedDesc, flags), flags);
+}
+
+static void vring_packed_event_read(VirtIODevice *vdev, hwaddr pa,
+                                    VRingPackedDescEvent *e)
+{
+    e->flags = virtio_lduw_phys(vdev,
+                                pa + offsetof(VRingPackedDescEvent, flags));
+    /* Make sure flags is seen before off_wrap. */
+    smp_rmb();
+    e->off_wrap = virtio_lduw_phys(vdev,
+                                   pa + offsetof(VRingPackedDescEvent,
+                                                 off_wrap));
+}
+
+static void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    hwaddr pa;
+
+    if (!vq->notification) {
+        return;
+    }
+    pa = vq->vring.used + offsetof(VRingPackedDescEvent, off_wrap);
+    virtio_stw_phys(vq->vdev, pa, vq->last_avail_idx |
+                    vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+}
+
+static inline bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    bool used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+
+    return avail != used && avail == wrap_counter;
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VirtIODevice *vdev = vq->vdev;
+    uint16_t flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+        /* Make sure off_wrap is written before flags. */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    virtio_stw_phys(vdev, vq->vring.used +
+                    offsetof(VRingPackedDescEvent, flags), flags);
+}
+
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -229,10 +361,26 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
+/* A packed ring has no avail index; the next descriptor's flags tell
+ * whether the guest made it available.
+ */
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    uint16_t flags;
+
+    vring_packed_desc_read_flags(vq->vdev, &flags, vq->vring.desc,
+                                 vq->last_avail_idx);
+    return !is_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers. */
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_queue_packed_empty(vq);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -275,10 +423,25 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len)
 {
-    vq->inuse--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        vq->inuse -= elem->ndescs;
+    } else {
+        vq->inuse--;
+    }
     virtqueue_unmap_sg(vq, elem, len);
 }
 
+/* Move last_avail_idx of a packed ring back by @num slots */
+static void virtqueue_packed_rewind_avail(VirtQueue *vq, unsigned int num)
+{
+    if (vq->last_avail_idx < num) {
+        vq->last_avail_idx += vq->vring.num - num;
+        vq->last_avail_wrap_counter ^= 1;
+    } else {
+        vq->last_avail_idx -= num;
+    }
+}
+
 /* virtqueue_unpop:
  * @vq: The #VirtQueue
  * @elem: The #VirtQueueElement
@@ -290,10 +453,47 @@ void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
                      unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_rewind_avail(vq, elem->ndescs);
+    } else {
+        vq->last_avail_idx--;
+    }
     virtqueue_detach_element(vq, elem, len);
 }
 
+/* Count the ring slots taken by the last @num elements popped from a packed
+ * ring.  Popped descriptors belong to the device until they are used, so
+ * their chains can still be followed backwards through VRING_DESC_F_NEXT.
+ *
+ * Returns: the number of slots, or more than vq->inuse if fewer than @num
+ * elements are in use.
+ */
+static unsigned int virtqueue_packed_rewind_count(VirtQueue *vq,
+                                                  unsigned int num)
+{
+    unsigned int idx = vq->last_avail_idx;
+    unsigned int ndescs = 0, elems = 0;
+    uint16_t flags;
+
+    rcu_read_lock();
+    while (elems < num && ndescs < vq->inuse) {
+        /* the last descriptor of the element, then the rest of its chain */
+        do {
+            idx = (idx ? idx : vq->vring.num) - 1;
+            ndescs++;
+            if (ndescs == vq->inuse) {
+                break;
+            }
+            vring_packed_desc_read_flags(vq->vdev, &flags, vq->vring.desc,
+                                         idx ? idx - 1 : vq->vring.num - 1);
+        } while (flags & VRING_DESC_F_NEXT);
+        elems++;
+    }
+    rcu_read_unlock();
+
+    return elems == num ? ndescs : vq->inuse + 1;
+}
+
 /* virtqueue_rewind:
  * @vq: The #VirtQueue
  * @num: Number of elements to push back
@@ -308,19 +508,48 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
  */
 bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
 {
-    if (num > vq->inuse) {
-        return false;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        /* vq->inuse counts ring slots, which chained elements have several of */
+        num = virtqueue_packed_rewind_count(vq, num);
+        if (num > vq->inuse) {
+            return false;
+        }
+        virtqueue_packed_rewind_avail(vq, num);
+    } else {
+        if (num > vq->inuse) {
+            return false;
+        }
+        vq->last_avail_idx -= num;
     }
-    vq->last_avail_idx -= num;
     vq->inuse -= num;
     return true;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                 unsigned int len, unsigned int idx)
 {
     VRingUsedElem uelem;
 
+    idx = (idx + vq->used_idx) % vq->vring.num;
+
+    uelem.id = elem->index;
+    uelem.len = len;
+    vring_used_write(vq, &uelem, idx);
+}
+
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    VRingPackedUsedElem *uelem = &vq->used_elems[idx % vq->vring.num];
+
+    uelem->index = elem->index;
+    uelem->len = len;
+    uelem->ndescs = elem->ndescs;
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
     trace_virtqueue_fill(vq, elem, len, idx);
 
     virtqueue_unmap_sg(vq, elem, len);
@@ -329,11 +558,48 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         return;
     }
 
-    idx = (idx + vq->used_idx) % vq->vring.num;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+    } else {
+        virtqueue_split_fill(vq, elem, len, idx);
+    }
+}
 
-    uelem.id = elem->index;
-    uelem.len = len;
-    vring_used_write(vq, &uelem, idx);
+/* Write back a batch of used elements.  The first element's flags are
+ * written last, so the guest sees either none or all of the batch.
+ */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, head, ndescs = 0;
+    bool wrap;
+
+    if (!count) {
+        return;
+    }
+
+    head = vq->used_idx;
+    wrap = vq->used_wrap_counter;
+    for (i = 0; i < count; i++) {
+        if (i) {
+            vring_packed_used_write(vq, &vq->used_elems[i], head, wrap, false);
+        }
+        ndescs += vq->used_elems[i].ndescs;
+        head += vq->used_elems[i].ndescs;
+        if (head >= vq->vring.num) {
+            head -= vq->vring.num;
+            wrap ^= 1;
+        }
+    }
+    vring_packed_used_write(vq, &vq->used_elems[0], vq->used_idx,
+                            vq->used_wrap_counter, true);
+
+    trace_virtqueue_flush(vq, count);
+    vq->inuse -= ndescs;
+    if (wrap != vq->used_wrap_counter) {
+        vq->signalled_used_valid = false;
+    }
+    vq->used_idx = head;
+    vq->used_wrap_counter = wrap;
 }
 
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
@@ -345,6 +611,11 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         return;
     }
 
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
+
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
@@ -427,9 +698,11 @@ static int virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
     return VIRTQUEUE_READ_DESC_MORE;
 }
 
-void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
-                               unsigned int *out_bytes,
-                               unsigned max_in_bytes, unsigned max_out_bytes)
+static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
+                                           unsigned int *in_bytes,
+                                           unsigned int *out_bytes,
+                                           unsigned max_in_bytes,
+                                           unsigned max_out_bytes)
 {
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
@@ -522,6 +795,132 @@ err:
     goto done;
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                            unsigned int *in_bytes,
+                                            unsigned int *out_bytes,
+                                            unsigned max_in_bytes,
+                                            unsigned max_out_bytes)
+{
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int idx, total_bufs, in_total, out_total;
+    bool wrap_counter;
+
+    idx = vq->last_avail_idx;
+    wrap_counter = vq->last_avail_wrap_counter;
+
+    total_bufs = in_total = out_total = 0;
+    for (;;) {
+        unsigned int max, num_bufs, indirect = 0;
+        VRingPackedDesc desc;
+        hwaddr desc_pa;
+        uint16_t flags;
+        unsigned int i;
+
+        desc_pa = vq->vring.desc;
+        vring_packed_desc_read_flags(vdev, &flags, desc_pa, idx);
+        if (!is_desc_avail(flags, wrap_counter)) {
+            break;
+        }
+        /* Read the descriptor only after its flags */
+        smp_rmb();
+
+        max = vq->vring.num;
+        num_bufs = total_bufs;
+        i = idx;
+        vring_packed_desc_read(vdev, &desc, desc_pa, i);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                virtio_error(vdev, "Invalid size for indirect buffer table");
+                goto err;
+            }
+
+            /* If we've got too many, that implies a descriptor loop. */
+            if (num_bufs >= max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            /* loop over the indirect descriptor table */
+            indirect = 1;
+            max = desc.len / sizeof(VRingPackedDesc);
+            desc_pa = desc.addr;
+            num_bufs = i = 0;
+            vring_packed_desc_read(vdev, &desc, desc_pa, i);
+        }
+
+        for (;;) {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                virtio_error(vdev, "Looped descriptor");
+                goto err;
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            if (indirect) {
+                /* indirect tables are not chained, all entries are used */
+                if (++i == max) {
+                    break;
+                }
+            } else {
+                if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                    break;
+                }
+                if (++i == vq->vring.num) {
+                    i = 0;
+                }
+            }
+            vring_packed_desc_read(vdev, &desc, desc_pa, i);
+        }
+
+        if (!indirect) {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        } else {
+            idx++;
+            total_bufs++;
+        }
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+
+done:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+    return;
+
+err:
+    in_total = out_total = 0;
+    goto done;
+}
+
+void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+    } else {
+        virtqueue_split_get_avail_bytes(vq, in_bytes, out_bytes,
+                                        max_in_bytes, max_out_bytes);
+    }
+}
+
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes)
 {
@@ -653,7 +1052,7 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
@@ -665,9 +1064,6 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    if (unlikely(vdev->broken)) {
-        return NULL;
-    }
     if (virtio_queue_empty(vq)) {
         return NULL;
     }
@@ -746,6 +1142,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
     elem->index = head;
+    elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -765,6 +1162,152 @@ err_undo_map:
     return NULL;
 }
 
+/* On a packed ring the buffer is described by consecutive ring slots, so
+ * the flags, the descriptors and (later) the used entry all share the
+ * same few cache lines.
+ */
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, max, ndescs, entries;
+    hwaddr desc_pa = vq->vring.desc;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
+
+    if (virtio_queue_packed_empty(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_packed_empty(): the descriptor must not
+     * be read before its flags.
+     */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = entries = 0;
+
+    max = vq->vring.num;
+
+    if (vq->inuse >= vq->vring.num) {
+        virtio_error(vdev, "Virtqueue size exceeded");
+        return NULL;
+    }
+
+    i = vq->last_avail_idx;
+    vring_packed_desc_read(vdev, &desc, desc_pa, i);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            virtio_error(vdev, "Invalid size for indirect buffer table");
+            return NULL;
+        }
+
+        /* loop over the indirect descriptor table */
+        indirect = true;
+        max = desc.len / sizeof(VRingPackedDesc);
+        desc_pa = desc.addr;
+        i = 0;
+        vring_packed_desc_read(vdev, &desc, desc_pa, i);
+    }
+
+    /* Collect all the descriptors */
+    for (;;) {
+        bool map_ok;
+
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+                                        iov + out_num,
+                                        VIRTQUEUE_MAX_SIZE - out_num, true,
+                                        desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                virtio_error(vdev, "Incorrect order for descriptors");
+                goto err_undo_map;
+            }
+            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+                                        VIRTQUEUE_MAX_SIZE, false,
+                                        desc.addr, desc.len);
+        }
+        if (!map_ok) {
+            goto err_undo_map;
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if (++entries > max) {
+            virtio_error(vdev, "Looped descriptor");
+            goto err_undo_map;
+        }
+
+        if (indirect) {
+            /* indirect tables are not chained, all entries are used */
+            if (++i == max) {
+                break;
+            }
+        } else {
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(vdev, &desc, desc_pa, i);
+        if (!indirect) {
+            /* the buffer id is the one in the last descriptor */
+            id = desc.id;
+        }
+    }
+    ndescs = indirect ? 1 : entries;
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = ndescs;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->inuse += ndescs;
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+
+err_undo_map:
+    virtqueue_undo_map_desc(out_num, in_num, iov);
+    return NULL;
+}
+
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    if (unlikely(vq->vdev->broken)) {
+        return NULL;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop(vq, sz);
+    } else {
+        return virtqueue_split_pop(vq, sz);
+    }
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -782,7 +1325,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -792,6 +1335,14 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
+
+    /* The old layout has no room for it; the stream format follows the
+     * configuration, not what the guest negotiated.
+     */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_get_be32s(f, &elem->ndescs);
+    }
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -817,7 +1368,8 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -846,6 +1398,10 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32s(f, &elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -956,6 +1512,8 @@ void virtio_reset(void *opaque)
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -1286,6 +1844,17 @@ void virtio_queue_set_vector(VirtIODevice *vdev, int n, uint16_t vector)
     }
 }
 
+/* Split rings write used elements straight to guest memory; only packed
+ * rings need somewhere to keep them until the flush.
+ */
+static void virtio_queue_alloc_used_elems(VirtQueue *vq)
+{
+    if (!vq->used_elems &&
+        virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        vq->used_elems = g_new0(VRingPackedUsedElem, VIRTQUEUE_MAX_SIZE);
+    }
+}
+
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             VirtIOHandleOutput handle_output)
 {
@@ -1304,6 +1873,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].handle_aio_output = NULL;
+    virtio_queue_alloc_used_elems(&vdev->vq[i]);
 
     return &vdev->vq[i];
 }
@@ -1316,6 +1886,8 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
 }
 
 static void virtio_set_isr(VirtIODevice *vdev, int value)
@@ -1330,6 +1902,45 @@ static void virtio_set_isr(VirtIODevice *vdev, int value)
     }
 }
 
+/* The driver's event offset is relative to its own view of the ring; move
+ * it to ours if it was taken on the other side of a wrap.
+ */
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    vring_packed_event_read(vdev, vq->vring.avail, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1342,6 +1953,10 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1427,6 +2042,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1480,6 +2102,30 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1597,6 +2243,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_ringsize,
         &vmstate_virtio_broken,
         &vmstate_virtio_extra_state,
+        &vmstate_virtio_packed_virtqueues,
         NULL
     }
 };
@@ -1680,12 +2327,19 @@ static int virtio_set_features_nocheck(VirtIODevice *vdev, uint64_t val)
 {
     VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(vdev);
     bool bad = (val & ~(vdev->host_features)) != 0;
+    int i;
 
     val &= vdev->host_features;
     if (k->set_features) {
         k->set_features(vdev, val);
     }
     vdev->guest_features = val;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num) {
+            virtio_queue_alloc_used_elems(&vdev->vq[i]);
+        }
+    }
     return bad ? -1 : 0;
 }
 
@@ -1837,7 +2491,26 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].vring.desc) {
+        if (vdev->vq[i].vring.desc &&
+            virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+            VirtQueue *vq = &vdev->vq[i];
+
+            /* There are no indices in guest memory; used_idx and the wrap
+             * counters came with the packed_virtqueues subsection.
+             */
+            vq->shadow_avail_idx = vq->last_avail_idx;
+            vq->inuse = vq->last_avail_idx - vq->used_idx;
+            if (vq->last_avail_wrap_counter != vq->used_wrap_counter) {
+                vq->inuse += vq->vring.num;
+            }
+            if (vq->inuse > vq->vring.num) {
+                error_report("VQ %d size 0x%x < last_avail_idx 0x%x - "
+                             "used_idx 0x%x",
+                             i, vq->vring.num, vq->last_avail_idx,
+                             vq->used_idx);
+                return -1;
+            }
+        } else if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1874,7 +2547,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        g_free(vdev->vq[i].used_elems);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1937,6 +2615,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1974,12 +2654,18 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -2047,15 +2733,29 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
     }
 }
 
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_aio_vq(vq);
+    return true;
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleOutput handle_output)
 {
     if (handle_output) {
         vq->handle_aio_output = handle_output;
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
-                               virtio_queue_host_notifier_aio_read);
+                               virtio_queue_host_notifier_aio_read,
+                               virtio_queue_host_notifier_aio_poll);
     } else {
-        aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
+        aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL, NULL);
         /* Test and clear notifier before after disabling event,
          * in case poll callback didn't have time to run. */
         virtio_queue_host_notifier_aio_read(&vq->host_notifier);
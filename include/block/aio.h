@@ -45,9 +45,11 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
 
 struct AioContext {
     GSource source;
@@ -124,6 +126,14 @@ struct AioContext {
      */
     struct LinuxAioState *linux_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring.  Uses aio_context_acquire/release for
+     * locking.
+     */
+    struct LuringState *linux_io_uring;
+#endif
+    /* Create the io_uring with a kernel submission polling thread */
+    bool linux_io_uring_sqpoll;
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
@@ -134,6 +144,19 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Adaptive polling.  Before blocking, aio_poll() calls the io_poll
+     * callbacks for up to poll_ns nanoseconds.  poll_ns grows while events
+     * arrive shortly after the polling window ended, up to poll_max_ns, and
+     * shrinks when the loop had to sleep for longer than poll_max_ns.
+     */
+    int poll_disable_cnt;   /* handlers without io_poll; polling is off */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+    uint64_t poll_hits;     /* polling found work, no sleep needed */
+    uint64_t poll_misses;   /* polling timed out, the loop went to sleep */
 };
 
 /**
@@ -317,6 +340,11 @@ bool aio_poll(AioContext *ctx, bool blocking);
  * to qemu_set_fd_handler.  Unlike qemu_set_fd_handler, these callbacks will
  * be invoked when using aio_poll().
  *
+ * @io_poll, if not NULL, is called while aio_poll() busy-waits and must
+ * check cheaply, without a system call, whether there is work to do.  If
+ * so it handles it and returns true.  Polling is disabled in an AioContext
+ * as long as one of its handlers has no io_poll callback.
+ *
  * Code that invokes AIO completion functions should rely on this function
  * instead of qemu_set_fd_handler[2].
  */
@@ -325,6 +353,7 @@ void aio_set_fd_handler(AioContext *ctx,
                         bool is_external,
                         IOHandler *io_read,
                         IOHandler *io_write,
+                        AioPollFn *io_poll,
                         void *opaque);
 
 /* Register an event notifier and associated callbacks.  Behaves very similarly
@@ -337,7 +366,8 @@ void aio_set_fd_handler(AioContext *ctx,
 void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             bool is_external,
-                            EventNotifierHandler *io_read);
+                            EventNotifierHandler *io_read,
+                            AioPollFn *io_poll);
 
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
@@ -350,6 +380,14 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Set up the io_uring of this AioContext if it does not exist yet */
+int aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext; it must have been set up
+ * with aio_setup_linux_io_uring().
+ */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -474,4 +512,17 @@ static inline bool aio_context_in_iothread(AioContext *ctx)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor; 0 selects the default
+ * @shrink: polling time shrink factor; 0 resets to no polling at once
+ *
+ * Configure adaptive polling.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
@@ -55,8 +55,9 @@ typedef uint64_t target_ulong;
 #endif
 
 #if !defined(CONFIG_USER_ONLY)
-/* use a fully associative victim tlb of 8 entries */
-#define CPU_VTLB_SIZE 8
+/* use a fully associative victim tlb, sized at configure time
+ * (--tcg-vtlb-size, 32 entries by default) */
+#define CPU_VTLB_SIZE CONFIG_TCG_VTLB_SIZE
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -129,6 +130,17 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* Per MMU mode TLB statistics, reported by "info jit".  They are only
+ * updated by the vCPU thread that owns the TLB.
+ */
+typedef struct CPUTLBStats {
+    uint64_t fill;          /* entries installed by tlb_set_page */
+    uint64_t vtlb_hit;      /* main TLB misses found in the victim TLB */
+    uint64_t vtlb_miss;     /* main TLB misses not in the victim TLB */
+    uint64_t flush;         /* full flushes of this MMU mode */
+    uint64_t flush_page;    /* single page flushes of this MMU mode */
+} CPUTLBStats;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
@@ -137,7 +149,8 @@ typedef struct CPUIOTLBEntry {
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
-    target_ulong vtlb_index;                                            \
+    target_ulong vtlb_index[NB_MMU_MODES];                              \
+    CPUTLBStats tlb_stats[NB_MMU_MODES];                                \
 
 #else
 
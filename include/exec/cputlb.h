@@ -26,6 +26,7 @@ void tlb_unprotect_code(ram_addr_t ram_addr);
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length);
 extern int tlb_flush_count;
+void dump_tlb_info(FILE *f, fprintf_function cpu_fprintf);
 
 #endif
 #endif
@@ -81,12 +81,27 @@ typedef struct {
     unsigned long *blocks[];
 } DirtyMemoryBlocks;
 
+/* Pages known to be zero, indexed by ram_addr_t page number.
+ *
+ * The map only exists while dirty logging is on; a bit is cleared as soon as
+ * cpu_physical_memory_sync_dirty_bitmap() harvests a write to the page, and
+ * is not trusted while the page's DIRTY_MEMORY_MIGRATION bit is set.  The
+ * generation count is odd while a harvest is clearing bits.
+ */
+typedef struct {
+    struct rcu_head rcu;
+    unsigned long pages;
+    unsigned long map[];
+} RAMZeroMap;
+
 typedef struct RAMList {
     QemuMutex mutex;
     RAMBlock *mru_block;
     /* RCU-enabled, writes protected by the ramlist lock. */
     QLIST_HEAD(, RAMBlock) blocks;
     DirtyMemoryBlocks *dirty_memory[DIRTY_MEMORY_NUM];
+    RAMZeroMap *zero_map;
+    unsigned zero_map_gen;
     uint32_t version;
 } RAMList;
 extern RAMList ram_list;
@@ -95,6 +110,14 @@ ram_addr_t last_ram_offset(void);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
 
+void ram_zero_map_start(void);
+void ram_zero_map_stop(void);
+void ram_zero_map_clear(ram_addr_t start, ram_addr_t length);
+unsigned long ram_block_zero_pages(RAMBlock *rb, ram_addr_t offset,
+                                   unsigned long max_pages);
+unsigned long ram_block_known_zero_pages(RAMBlock *rb, ram_addr_t offset,
+                                         unsigned long max_pages);
+
 RAMBlock *qemu_ram_alloc_from_file(ram_addr_t size, MemoryRegion *mr,
                                    bool share, const char *mem_path,
                                    Error **errp);
@@ -401,6 +424,14 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
     ram_addr_t addr;
     unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
+    RAMZeroMap *zm;
+
+    rcu_read_lock();
+    zm = atomic_rcu_read(&ram_list.zero_map);
+    if (zm) {
+        atomic_inc(&ram_list.zero_map_gen);
+        smp_mb();
+    }
 
     /* start address is aligned at the start of a word? */
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
@@ -420,6 +451,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
             if (src[idx][offset]) {
                 unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
+                if (zm && k < BITS_TO_LONGS(zm->pages)) {
+                    atomic_and(&zm->map[k], ~bits);
+                }
                 new_dirty = ~dest[k];
                 dest[k] |= bits;
                 new_dirty &= bits;
@@ -440,6 +474,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
                         TARGET_PAGE_SIZE,
                         DIRTY_MEMORY_MIGRATION)) {
                 long k = (start + addr) >> TARGET_PAGE_BITS;
+                if (zm && k < zm->pages) {
+                    atomic_and(&zm->map[BIT_WORD(k)], ~BIT_MASK(k));
+                }
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
@@ -447,6 +484,12 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
         }
     }
 
+    if (zm) {
+        smp_mb();
+        atomic_inc(&ram_list.zero_map_gen);
+    }
+    rcu_read_unlock();
+
     return num_dirty;
 }
 
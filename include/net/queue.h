@@ -45,6 +45,12 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* Returns the number of packets delivered */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       const struct iovec *pkts,
+                                       int npkts,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -70,6 +76,12 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              const struct iovec *pkts,
+                              int npkts,
+                              NetQueueDeliverBatchFunc *deliver_batch);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
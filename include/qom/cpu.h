@@ -296,6 +296,8 @@ struct qemu_work_item;
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
+ * @pending_tlb_flush: Bitmask of MMU indexes with a TLB flush queued on
+ * this vCPU by another thread (MTTCG).
  *
  * State of one CPU core or thread.
  */
@@ -387,6 +389,11 @@ struct CPUState {
      */
     bool throttle_thread_scheduled;
 
+    /* Accessed atomically; a flush requested from another thread is
+     * deferred to the vCPU's own thread via async_run_on_cpu.
+     */
+    uint16_t pending_tlb_flush;
+
     /* Note that this is accessed at the start of every TB via a negative
        offset from AREG0.  Leave this field at the end so as to make the
        (absolute value) offset as small as possible.  This reduces code
@@ -406,6 +413,15 @@ extern struct CPUTailQ cpus;
 
 extern __thread CPUState *current_cpu;
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether we are running MultiThread TCG or not.
+ *
+ * Returns: %true if we are in MTTCG mode %false otherwise.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -177,6 +177,11 @@ typedef struct DumpState {
     off_t offset_page;          /* offset of page part in vmcore */
     size_t num_dumpable;        /* number of page that can be dumped */
     uint32_t flag_compress;     /* indicate the compression format */
+    uint32_t compress_threads;  /* number of page compression threads */
+    bool zero_map_synced;       /* dirty log synced, zero map can be used */
+    bool live;                  /* copy memory while the guest runs */
+    unsigned long *live_bitmap; /* pages to copy again (live dump) */
+    Error *live_blocker;        /* blocks migration during a live dump */
     DumpStatus status;          /* current dump status */
 
     bool has_format;              /* whether format is provided */
@@ -75,10 +75,14 @@ void qemu_add_machine_init_done_notifier(Notifier *notify);
 void qemu_remove_machine_init_done_notifier(Notifier *notify);
 
 void hmp_savevm(Monitor *mon, const QDict *qdict);
+bool savevm_in_background(void);
 int load_vmstate(const char *name);
 void hmp_delvm(Monitor *mon, const QDict *qdict);
 void hmp_info_snapshots(Monitor *mon, const QDict *qdict);
 
+bool fast_snapshot_active(void);
+void fast_snapshot_drop(void);
+
 void qemu_announce_self(void);
 
 /* Subcommands for QEMU_VM_COMMAND */
@@ -128,6 +132,7 @@ void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
                                            uint64_t *length_list);
 
 int qemu_loadvm_state(QEMUFile *f);
+int qemu_save_device_state(QEMUFile *f);
 
 extern int autostart;
 
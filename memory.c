@@ -2267,6 +2267,7 @@ void memory_global_dirty_log_sync(void)
 void memory_global_dirty_log_start(void)
 {
     global_dirty_log = true;
+    ram_zero_map_start();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
 
@@ -2286,6 +2287,7 @@ void memory_global_dirty_log_stop(void)
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
+    ram_zero_map_stop();
 }
 
 static void listener_add_address_space(MemoryListener *listener,
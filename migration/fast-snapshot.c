@@ -0,0 +1,370 @@
+/*
+ * In-memory VM snapshots with dirty page revert
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A fast snapshot keeps a private copy of every RAMBlock plus the device
+ * state in host memory, then turns on dirty logging.  Reverting only has
+ * to copy back the pages that the dirty log reports as written since the
+ * snapshot (or the previous revert) and to reload the device state, so
+ * its cost depends on how much the guest touched rather than on its size.
+ *
+ * Dirty logging reuses the DIRTY_MEMORY_MIGRATION bitmap, so migration
+ * and live dumps cannot run while a fast snapshot exists.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+#include "exec/memory.h"
+#include "block/block.h"
+#include "sysemu/sysemu.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "io/channel-buffer.h"
+
+/* Pages checked at once when looking for zero runs to skip */
+#define FAST_SNAPSHOT_ZERO_SCAN 64
+
+typedef struct FastSnapshotBlock {
+    char idstr[256];
+    ram_addr_t offset;
+    ram_addr_t length;
+    /* anonymous mapping; pages that were zero are never touched */
+    uint8_t *copy;
+} FastSnapshotBlock;
+
+static struct {
+    bool active;
+    FastSnapshotBlock *blocks;
+    int nr_blocks;
+    /* last_ram_offset() when the snapshot was taken */
+    ram_addr_t ram_size;
+    /* scratch bitmap covering the whole ram_addr_t space */
+    unsigned long *dirty;
+    uint8_t *devices;
+    size_t devices_size;
+    Error *blocker;
+} fast_snapshot;
+
+bool fast_snapshot_active(void)
+{
+    return fast_snapshot.active;
+}
+
+/* Called with the iothread lock held */
+void fast_snapshot_drop(void)
+{
+    int i;
+
+    if (!fast_snapshot.active) {
+        return;
+    }
+
+    memory_global_dirty_log_stop();
+    migrate_del_blocker(fast_snapshot.blocker);
+    error_free(fast_snapshot.blocker);
+
+    for (i = 0; i < fast_snapshot.nr_blocks; i++) {
+        qemu_anon_ram_free(fast_snapshot.blocks[i].copy,
+                           fast_snapshot.blocks[i].length);
+    }
+    g_free(fast_snapshot.blocks);
+    g_free(fast_snapshot.dirty);
+    g_free(fast_snapshot.devices);
+    memset(&fast_snapshot, 0, sizeof(fast_snapshot));
+}
+
+/* Throw away the dirty bits accumulated so far */
+static void fast_snapshot_clear_dirty(void)
+{
+    int i;
+
+    memory_global_dirty_log_sync();
+    for (i = 0; i < fast_snapshot.nr_blocks; i++) {
+        cpu_physical_memory_sync_dirty_bitmap(fast_snapshot.dirty,
+                                              fast_snapshot.blocks[i].offset,
+                                              fast_snapshot.blocks[i].length);
+    }
+    bitmap_zero(fast_snapshot.dirty,
+                fast_snapshot.ram_size >> TARGET_PAGE_BITS);
+}
+
+static int fast_snapshot_copy_ram(Error **errp)
+{
+    RAMBlock *block;
+    int i = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        fast_snapshot.nr_blocks++;
+    }
+    fast_snapshot.blocks = g_new0(FastSnapshotBlock, fast_snapshot.nr_blocks);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        FastSnapshotBlock *fb = &fast_snapshot.blocks[i++];
+        ram_addr_t off;
+
+        pstrcpy(fb->idstr, sizeof(fb->idstr), block->idstr);
+        fb->offset = block->offset;
+        fb->length = block->used_length;
+        fb->copy = qemu_anon_ram_alloc(fb->length, NULL);
+        if (!fb->copy) {
+            rcu_read_unlock();
+            fb->length = 0;
+            error_setg(errp, "Cannot allocate %" PRIu64 " bytes for a copy "
+                       "of RAM block '%s'", (uint64_t)block->used_length,
+                       block->idstr);
+            return -ENOMEM;
+        }
+
+        for (off = 0; off < fb->length; ) {
+            unsigned long zero;
+
+            zero = ram_block_zero_pages(block, off, FAST_SNAPSHOT_ZERO_SCAN);
+            if (zero) {
+                off += (ram_addr_t)zero << TARGET_PAGE_BITS;
+            } else {
+                memcpy(fb->copy + off, block->host + off, TARGET_PAGE_SIZE);
+                off += TARGET_PAGE_SIZE;
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    return 0;
+}
+
+static int fast_snapshot_save_devices(Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "fast-snapshot-buffer");
+    f = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ret = qemu_save_device_state(f);
+    qemu_fflush(f);
+    if (ret == 0) {
+        fast_snapshot.devices = g_memdup(bioc->data, bioc->usage);
+        fast_snapshot.devices_size = bioc->usage;
+    } else {
+        error_setg(errp, "Error %d while saving device state", ret);
+    }
+    qemu_fclose(f);
+
+    return ret;
+}
+
+static int fast_snapshot_load_devices(Error **errp)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    int ret;
+
+    bioc = qio_channel_buffer_new(fast_snapshot.devices_size);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "fast-snapshot-buffer");
+    memcpy(bioc->data, fast_snapshot.devices, fast_snapshot.devices_size);
+    bioc->usage = fast_snapshot.devices_size;
+    f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    migration_incoming_state_new(f);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    migration_incoming_state_destroy();
+    if (ret < 0) {
+        error_setg(errp, "Error %d while loading device state", ret);
+    }
+
+    return ret;
+}
+
+/* Check that the RAM blocks still match the snapshot */
+static int fast_snapshot_check_ram(Error **errp)
+{
+    int i;
+
+    if (last_ram_offset() != fast_snapshot.ram_size) {
+        error_setg(errp, "RAM layout changed since the fast snapshot");
+        return -1;
+    }
+
+    rcu_read_lock();
+    for (i = 0; i < fast_snapshot.nr_blocks; i++) {
+        FastSnapshotBlock *fb = &fast_snapshot.blocks[i];
+        RAMBlock *block = qemu_ram_block_by_name(fb->idstr);
+
+        if (!block || block->offset != fb->offset ||
+            block->used_length != fb->length) {
+            rcu_read_unlock();
+            error_setg(errp, "RAM block '%s' changed since the fast snapshot",
+                       fb->idstr);
+            return -1;
+        }
+    }
+    rcu_read_unlock();
+
+    return 0;
+}
+
+/* Copy back every page written since the last call.  The RAM layout must
+ * have been checked with fast_snapshot_check_ram().
+ *
+ * Returns the number of pages restored.
+ */
+static int64_t fast_snapshot_restore_ram(void)
+{
+    int64_t pages = 0;
+    int i;
+
+    memory_global_dirty_log_sync();
+
+    rcu_read_lock();
+    /* Harvest the dirty log of all blocks before restoring any of them:
+     * the sync works on whole bitmap words, which can be shared with a
+     * neighbouring block.
+     */
+    for (i = 0; i < fast_snapshot.nr_blocks; i++) {
+        cpu_physical_memory_sync_dirty_bitmap(fast_snapshot.dirty,
+                                              fast_snapshot.blocks[i].offset,
+                                              fast_snapshot.blocks[i].length);
+    }
+
+    for (i = 0; i < fast_snapshot.nr_blocks; i++) {
+        FastSnapshotBlock *fb = &fast_snapshot.blocks[i];
+        RAMBlock *block = qemu_ram_block_by_name(fb->idstr);
+        unsigned long first, last, page;
+
+        first = fb->offset >> TARGET_PAGE_BITS;
+        last = first + (fb->length >> TARGET_PAGE_BITS);
+        for (page = find_next_bit(fast_snapshot.dirty, last, first);
+             page < last;
+             page = find_next_bit(fast_snapshot.dirty, last, page + 1)) {
+            ram_addr_t off = (page - first) << TARGET_PAGE_BITS;
+
+            memcpy(block->host + off, fb->copy + off, TARGET_PAGE_SIZE);
+            clear_bit(page, fast_snapshot.dirty);
+            pages++;
+        }
+    }
+    rcu_read_unlock();
+
+    return pages;
+}
+
+void qmp_fast_snapshot_save(Error **errp)
+{
+    int saved_vm_running;
+
+    if (!migration_is_idle()) {
+        error_setg(errp, "Cannot take a fast snapshot during migration");
+        return;
+    }
+    if (dump_in_progress()) {
+        error_setg(errp, "Cannot take a fast snapshot during a memory dump");
+        return;
+    }
+
+    fast_snapshot_drop();
+
+    saved_vm_running = runstate_is_running();
+    if (global_state_store()) {
+        error_setg(errp, "Error saving global state");
+        return;
+    }
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    fast_snapshot.active = true;
+    fast_snapshot.ram_size = last_ram_offset();
+    fast_snapshot.dirty = bitmap_new(fast_snapshot.ram_size >>
+                                     TARGET_PAGE_BITS);
+    error_setg(&fast_snapshot.blocker, "A fast snapshot is active");
+    migrate_add_blocker(fast_snapshot.blocker);
+
+    /* Start logging before the copy; nothing runs until vm_start() so the
+     * copy and the empty bitmap describe the same point in time.  If logging
+     * was already on, sync it so that the zero map used by the copy does not
+     * miss writes that were not harvested yet.
+     */
+    memory_global_dirty_log_start();
+    memory_global_dirty_log_sync();
+
+    if (fast_snapshot_copy_ram(errp) < 0 ||
+        fast_snapshot_save_devices(errp) < 0) {
+        fast_snapshot_drop();
+        goto out;
+    }
+    fast_snapshot_clear_dirty();
+
+out:
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+FastSnapshotRevertInfo *qmp_fast_snapshot_revert(Error **errp)
+{
+    FastSnapshotRevertInfo *info;
+    int saved_vm_running;
+    int64_t start, pages;
+
+    if (!fast_snapshot.active) {
+        error_setg(errp, "No fast snapshot has been taken");
+        return NULL;
+    }
+    /* Refuse before the reset, so that the guest is left untouched */
+    if (fast_snapshot_check_ram(errp) < 0) {
+        return NULL;
+    }
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_RESTORE_VM);
+
+    /* Flush all IO requests so they don't interfere with the new state */
+    bdrv_drain_all();
+
+    /* Reset before restoring RAM: ROMs reloaded by the reset end up in the
+     * dirty log and are put back like any other page.
+     */
+    qemu_system_reset(VMRESET_SILENT);
+
+    pages = fast_snapshot_restore_ram();
+    if (fast_snapshot_load_devices(errp) < 0) {
+        /* RAM is already reverted, there is no state left to resume */
+        return NULL;
+    }
+
+    if (saved_vm_running) {
+        vm_start();
+    }
+
+    info = g_new0(FastSnapshotRevertInfo, 1);
+    info->dirty_pages = pages;
+    info->duration = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
+    return info;
+}
+
+void qmp_fast_snapshot_delete(Error **errp)
+{
+    if (!fast_snapshot.active) {
+        error_setg(errp, "No fast snapshot has been taken");
+        return;
+    }
+    fast_snapshot_drop();
+}
@@ -68,6 +68,9 @@
  */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 
+/* Number of parallel RAM connections used when multifd is enabled */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -101,6 +104,7 @@ MigrationState *migrate_get_current(void)
             .max_bandwidth = MAX_THROTTLE,
             .downtime_limit = DEFAULT_MIGRATE_SET_DOWNTIME,
             .x_checkpoint_delay = DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+            .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
         },
     };
 
@@ -391,6 +395,7 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    multifd_load_cleanup();
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -595,6 +600,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->downtime_limit = s->parameters.downtime_limit;
     params->has_x_checkpoint_delay = true;
     params->x_checkpoint_delay = s->parameters.x_checkpoint_delay;
+    params->has_multifd_channels = true;
+    params->multifd_channels = s->parameters.multifd_channels;
 
     return params;
 }
@@ -617,6 +624,26 @@ static bool migration_is_setup_or_active(int state)
     }
 }
 
+/*
+ * Return true if no outgoing migration is running, i.e. nothing else is
+ * consuming the DIRTY_MEMORY_MIGRATION bitmap.
+ */
+bool migration_is_idle(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    switch (s->state) {
+    case MIGRATION_STATUS_NONE:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_COMPLETED:
+    case MIGRATION_STATUS_FAILED:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -625,7 +652,9 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_eviction = xbzrle_mig_pages_cache_eviction();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
@@ -798,6 +827,20 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* Pages on the multifd channels land in RAM asynchronously and are
+         * only ordered against the main stream at sync points, which
+         * neither postcopy nor COLO checkpoints know about.  Compression
+         * would simply take precedence and leave the channels idle.
+         */
+        if (migrate_postcopy_ram() || migrate_colo_enabled() ||
+            migrate_use_compression()) {
+            error_report("multifd is not currently compatible with "
+                         "postcopy, COLO or compression");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
@@ -858,6 +901,13 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
                     "x_checkpoint_delay",
                     "is invalid, it should be positive");
     }
+    if (params->has_multifd_channels &&
+        (params->multifd_channels < 1 || params->multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
 
     if (params->has_compress_level) {
         s->parameters.compress_level = params->compress_level;
@@ -896,6 +946,9 @@ void qmp_migrate_set_parameters(MigrationParameters *params, Error **errp)
     if (params->has_x_checkpoint_delay) {
         s->parameters.x_checkpoint_delay = params->x_checkpoint_delay;
     }
+    if (params->has_multifd_channels) {
+        s->parameters.multifd_channels = params->multifd_channels;
+    }
 }
 
 
@@ -950,6 +1003,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_save_cleanup();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -1005,6 +1059,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
     }
 }
 
@@ -1160,6 +1215,17 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "multifd requires a tcp: or unix: migration URI");
+            return;
+        }
+        if (s->parameters.tls_creds) {
+            error_setg(errp, "multifd is not supported with TLS");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1314,6 +1380,24 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_channels;
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1969,6 +2053,7 @@ void migrate_fd_connect(MigrationState *s)
     }
 
     migrate_compress_threads_create();
+    multifd_save_setup();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
@@ -44,6 +44,8 @@
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
+#include "io/channel.h"
+#include "qemu/iov.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -69,9 +71,13 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static uint8_t *ZERO_TARGET_PAGE;
 
+/* How many pages save_zero_page() scans at once during the bulk stage */
+#define ZERO_LOOKAHEAD_PAGES 64
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -152,7 +158,9 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_eviction;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
@@ -204,11 +212,21 @@ uint64_t xbzrle_mig_pages_transferred(void)
     return acct_info.xbzrle_pages;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_cache_miss(void)
 {
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_eviction(void)
+{
+    return acct_info.xbzrle_cache_eviction;
+}
+
 double xbzrle_mig_cache_miss_rate(void)
 {
     return acct_info.xbzrle_cache_miss_rate;
@@ -253,75 +271,133 @@ static struct BitmapRcu {
     unsigned long *unsentmap;
 } *migration_bitmap_rcu;
 
+/*
+ * Compression threads
+ *
+ * The migration thread groups the pages to compress into units of up to
+ * COMPRESS_UNIT_PAGES pages of the same RAMBlock.  Each compression
+ * thread owns a ring of COMPRESS_RING_SIZE units; the migration thread
+ * is the only producer and the compression thread the only consumer, so
+ * the ring indexes need no lock: @head and @tail are only written by the
+ * migration thread, @done only by the compression thread.  A unit is
+ * handed over with a semaphore post, and completions are signalled
+ * through a single QemuEvent that the migration thread only waits on
+ * when every ring is full.
+ *
+ * A compressed unit is a run of ready-made page records that the
+ * migration thread copies into the stream as is; the wire format is the
+ * same as with one page per record.
+ */
+#define COMPRESS_UNIT_PAGES     16
+#define COMPRESS_RING_SIZE      4
+
+typedef struct CompressUnit {
+    RAMBlock *block;
+    /* offsets in @block, including RAM_SAVE_FLAG_CONTINUE */
+    ram_addr_t offset[COMPRESS_UNIT_PAGES];
+    int nr_pages;
+    uint8_t *out;
+    /* bytes of page records in @out, -1 if compression failed */
+    ssize_t out_len;
+} CompressUnit;
+
 struct CompressParam {
-    bool done;
+    /* units submitted and written to the stream, migration thread only */
+    unsigned head;
+    unsigned tail;
+    /* units compressed, compression thread only */
+    unsigned done;
     bool quit;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
-    RAMBlock *block;
-    ram_addr_t offset;
+    QemuSemaphore sem;
+    CompressUnit units[COMPRESS_RING_SIZE];
 };
 typedef struct CompressParam CompressParam;
 
+#define DECOMPRESS_UNIT_PAGES   16
+#define DECOMPRESS_RING_SIZE    4
+
+typedef struct DecompressUnit {
+    int nr_pages;
+    void *host[DECOMPRESS_UNIT_PAGES];
+    int len[DECOMPRESS_UNIT_PAGES];
+    /* compressed pages, back to back */
+    uint8_t *compbuf;
+    size_t used;
+} DecompressUnit;
+
+/* Same scheme as CompressParam, with the load thread as the producer */
 struct DecompressParam {
-    bool done;
+    unsigned head;
+    unsigned done;
     bool quit;
-    QemuMutex mutex;
-    QemuCond cond;
-    void *des;
-    uint8_t *compbuf;
-    int len;
+    QemuSemaphore sem;
+    DecompressUnit units[DECOMPRESS_RING_SIZE];
 };
 typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
- */
-static QemuMutex comp_done_lock;
-static QemuCond comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+/* set by the compression threads each time they finish a unit */
+static QemuEvent comp_done_event;
+/* thread whose unit at @head is being filled, or NULL */
+static CompressParam *comp_open;
+/* where to start looking for a thread with a free unit */
+static int comp_next;
 
 static bool compression_switch;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
-static QemuMutex decomp_done_lock;
-static QemuCond decomp_done_cond;
+static QemuEvent decomp_done_event;
+static DecompressParam *decomp_open;
+static int decomp_next;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+/* Size of the largest record for a compressed page */
+static size_t compress_record_max(void)
+{
+    return sizeof(uint64_t) + sizeof(uint32_t) +
+           compressBound(TARGET_PAGE_SIZE);
+}
+
+static void do_compress_unit(CompressUnit *unit)
+{
+    int level = migrate_compress_level();
+    uint8_t *out = unit->out;
+    int i;
+
+    for (i = 0; i < unit->nr_pages; i++) {
+        ram_addr_t offset = unit->offset[i];
+        uint8_t *p = unit->block->host + (offset & TARGET_PAGE_MASK);
+        uLongf blen = compressBound(TARGET_PAGE_SIZE);
+
+        /* the block name is only ever sent by the migration thread */
+        assert(offset & RAM_SAVE_FLAG_CONTINUE);
+        stq_be_p(out, offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+        if (compress2(out + 12, &blen, p, TARGET_PAGE_SIZE,
+                      level) != Z_OK) {
+            unit->out_len = -1;
+            return;
+        }
+        stl_be_p(out + 8, blen);
+        out += 12 + blen;
+    }
+    unit->out_len = out - unit->out;
+}
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
-    RAMBlock *block;
-    ram_addr_t offset;
-
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->block) {
-            block = param->block;
-            offset = param->offset;
-            param->block = NULL;
-            qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+    for (;;) {
+        qemu_sem_wait(&param->sem);
+        if (atomic_read(&param->quit)) {
+            break;
+        }
 
-            qemu_mutex_lock(&comp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&comp_done_cond);
-            qemu_mutex_unlock(&comp_done_lock);
+        do_compress_unit(&param->units[param->done % COMPRESS_RING_SIZE]);
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
-        }
+        atomic_mb_set(&param->done, param->done + 1);
+        qemu_event_set(&comp_done_event);
     }
-    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
@@ -332,16 +408,14 @@ static inline void terminate_compression_threads(void)
 
     thread_count = migrate_compress_threads();
     for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        comp_param[idx].quit = true;
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+        atomic_set(&comp_param[idx].quit, true);
+        qemu_sem_post(&comp_param[idx].sem);
     }
 }
 
 void migrate_compress_threads_join(void)
 {
-    int i, thread_count;
+    int i, j, thread_count;
 
     if (!migrate_use_compression()) {
         return;
@@ -350,21 +424,22 @@ void migrate_compress_threads_join(void)
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
+        qemu_sem_destroy(&comp_param[i].sem);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            g_free(comp_param[i].units[j].out);
+        }
     }
-    qemu_mutex_destroy(&comp_done_lock);
-    qemu_cond_destroy(&comp_done_cond);
+    qemu_event_destroy(&comp_done_event);
     g_free(compress_threads);
     g_free(comp_param);
     compress_threads = NULL;
     comp_param = NULL;
+    comp_open = NULL;
 }
 
 void migrate_compress_threads_create(void)
 {
-    int i, thread_count;
+    int i, j, thread_count;
 
     if (!migrate_use_compression()) {
         return;
@@ -373,17 +448,15 @@ void migrate_compress_threads_create(void)
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
-    qemu_cond_init(&comp_done_cond);
-    qemu_mutex_init(&comp_done_lock);
+    qemu_event_init(&comp_done_event, false);
+    comp_open = NULL;
+    comp_next = 0;
     for (i = 0; i < thread_count; i++) {
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        comp_param[i].quit = false;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            comp_param[i].units[j].out =
+                g_malloc(COMPRESS_UNIT_PAGES * compress_record_max());
+        }
+        qemu_sem_init(&comp_param[i].sem, 0);
         qemu_thread_create(compress_threads + i, "compress",
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -453,8 +526,10 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
-                 bitmap_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
+                     bitmap_sync_count) == 1) {
+        acct_info.xbzrle_cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -481,14 +556,17 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
 {
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
+    int ret;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             bitmap_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               bitmap_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                acct_info.xbzrle_cache_eviction += ret;
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -496,6 +574,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         }
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -701,7 +780,11 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 {
     int pages = -1;
 
-    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+    /* During the bulk stage, scan ahead so that the pages that follow are
+     * answered from the zero-range map instead of being read again.
+     */
+    if (ram_block_zero_pages(block, offset & TARGET_PAGE_MASK,
+                             ram_bulk_stage ? ZERO_LOOKAHEAD_PAGES : 1)) {
         acct_info.dup_pages++;
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_COMPRESS);
@@ -805,95 +888,849 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+static uint64_t bytes_transferred;
+
+/* Multiple fd's
+ *
+ * With the multifd capability, normal (non-zero) RAM pages are not written
+ * to the main migration stream.  The migration thread batches them per
+ * RAMBlock and hands each batch to one of several sender threads, every one
+ * of which owns its own socket to the destination.  A packet carries the
+ * RAMBlock name and the offset of each page, so the receiving threads can
+ * write the pages straight into guest RAM in whatever order they arrive.
+ *
+ * The only ordering that matters is between dirty bitmap rounds: a page
+ * resent in round N+1 must not be overwritten by its stale copy from round
+ * N.  So when a new round starts, the migration thread waits for all the
+ * channels to drain, sends a SYNC packet on each of them and puts a
+ * RAM_SAVE_FLAG_MULTIFD_SYNC marker on the main stream.  On the
+ * destination, ram_load() waits at the marker until every channel has
+ * reached its SYNC packet, and only then lets them continue.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* 256 KiB of payload per packet with 4 KiB target pages */
+#define MULTIFD_PAGES_PER_PACKET 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t id;
+    uint8_t unused[7];
+} QEMU_PACKED MultiFDInit;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    /* number of pages following the header */
+    uint32_t pages;
+    uint32_t unused;
+    uint64_t packet_num;
+    char ramblock[256];
+    /* only the first 'pages' entries are sent */
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+} QEMU_PACKED MultiFDPacket;
+
+typedef struct {
+    RAMBlock *block;
+    uint32_t num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    /* kicks the thread when a job is queued or it has to quit */
+    QemuSemaphore sem;
+    /* protects the fields below */
+    QemuMutex mutex;
+    QIOChannel *c;
+    bool quit;
+    /* a job has been queued and not sent yet */
+    bool pending_job;
+    /* the job is a SYNC packet */
+    bool sync;
+    uint64_t packet_num;
+    /* owned by the thread while pending_job is set */
+    MultiFDPages *pages;
+    MultiFDPacket *packet;
+    struct iovec *iov;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* batch being filled by the migration thread */
+    MultiFDPages *pages;
+    /* number of channels without a pending job */
+    QemuSemaphore channels_ready;
+    uint64_t packet_num;
+    int next_channel;
+    /* packets have been queued since the last SYNC */
+    bool unsynced;
+    /* dirty bitmap round the channels were last synced for */
+    uint64_t sync_round;
+    /* set by a channel that could not send */
+    bool failed;
+} *multifd_send_state;
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted by the main thread once every channel reached a SYNC */
+    QemuSemaphore sem_resume;
+    bool quit;
+    MultiFDPacket *packet;
+    struct iovec *iov;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    /* channels accepted so far; only touched by the main thread */
+    int connected;
+    /* posted by each channel when it reaches a SYNC or exits */
+    QemuSemaphore sem_sync;
+    bool failed;
+} *multifd_recv_state;
+
+/*
+ * Transfer the whole of @iov on a blocking channel.
+ *
+ * Returns 1 on success, 0 if a read hit end of file before any data
+ * arrived, and -1 on error.
+ */
+static int multifd_channel_io(QIOChannel *c, struct iovec *iov,
+                              unsigned int niov, bool is_write,
+                              Error **errp)
 {
-    int bytes_sent, blen;
-    uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+    bool first = true;
+
+    while (niov > 0) {
+        ssize_t len;
+
+        if (is_write) {
+            len = qio_channel_writev(c, iov, niov, errp);
+        } else {
+            len = qio_channel_readv(c, iov, niov, errp);
+        }
+        if (len < 0) {
+            if (len == QIO_CHANNEL_ERR_BLOCK) {
+                error_setg(errp, "multifd channel is not blocking");
+            }
+            return -1;
+        }
+        if (len == 0 && !is_write) {
+            if (first) {
+                return 0;
+            }
+            error_setg(errp, "Unexpected end of multifd channel");
+            return -1;
+        }
+        first = false;
+        iov_discard_front(&iov, &niov, len);
+    }
 
-    bytes_sent = save_page_header(f, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    if (blen < 0) {
-        bytes_sent = 0;
-        qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
-        error_report("compressed data failed!");
+    return 1;
+}
+
+static void multifd_send_fail(MultiFDSendParams *p, Error *err)
+{
+    if (!atomic_xchg(&multifd_send_state->failed, true)) {
+        error_reportf_err(err, "multifd channel %d: ", p->id);
     } else {
-        bytes_sent += blen;
+        error_free(err);
     }
+}
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit msg = { 0 };
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
 
-    return bytes_sent;
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+
+    return multifd_channel_io(p->c, &iov, 1, true, errp);
 }
 
-static uint64_t bytes_transferred;
+static int multifd_send_packet(MultiFDSendParams *p, uint32_t flags,
+                               Error **errp)
+{
+    MultiFDPages *pages = p->pages;
+    MultiFDPacket *packet = p->packet;
+    int i;
 
-static void flush_compressed_data(QEMUFile *f)
+    memset(packet, 0, offsetof(MultiFDPacket, offset));
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->flags = cpu_to_be32(flags);
+    packet->pages = cpu_to_be32(pages->num);
+    packet->packet_num = cpu_to_be64(p->packet_num);
+    if (pages->num) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
+
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = offsetof(MultiFDPacket, offset) +
+                        pages->num * sizeof(uint64_t);
+    for (i = 0; i < pages->num; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+        p->iov[i + 1].iov_base = pages->block->host + pages->offset[i];
+        p->iov[i + 1].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return multifd_channel_io(p->c, p->iov, pages->num + 1, true, errp);
+}
+
+static void *multifd_send_thread(void *opaque)
 {
-    int idx, len, thread_count;
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    QIOChannel *c;
 
-    if (!migrate_use_compression()) {
+    rcu_register_thread();
+
+    c = socket_send_channel_create(&local_err);
+    if (c) {
+        qio_channel_set_blocking(c, true, NULL);
+        qemu_mutex_lock(&p->mutex);
+        p->c = c;
+        qemu_mutex_unlock(&p->mutex);
+        multifd_send_initial_packet(p, &local_err);
+    }
+    if (local_err) {
+        multifd_send_fail(p, local_err);
+        local_err = NULL;
+    }
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job) {
+            uint32_t flags = p->sync ? MULTIFD_FLAG_SYNC : 0;
+
+            qemu_mutex_unlock(&p->mutex);
+
+            /* Once a channel failed the migration is going to be
+             * cancelled; keep draining jobs so the migration thread
+             * never waits for us.
+             */
+            if (!atomic_read(&multifd_send_state->failed)) {
+                rcu_read_lock();
+                if (multifd_send_packet(p, flags, &local_err) < 0) {
+                    multifd_send_fail(p, local_err);
+                    local_err = NULL;
+                }
+                rcu_read_unlock();
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages->num = 0;
+            p->pending_job = false;
+            p->sync = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+            continue;
+        }
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+void multifd_save_setup(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
         return;
     }
-    thread_count = migrate_compress_threads();
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = thread_count;
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    multifd_send_state->sync_round = bitmap_sync_count;
+    qemu_sem_init(&multifd_send_state->channels_ready, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
 
-    qemu_mutex_lock(&comp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!comp_param[idx].done) {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        p->id = i;
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->pages = g_new0(MultiFDPages, 1);
+        p->packet = g_new0(MultiFDPacket, 1);
+        p->iov = g_new0(struct iovec, MULTIFD_PAGES_PER_PACKET + 1);
+        qemu_thread_create(&p->thread, "multifd-send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Called from the main thread when the migration is cancelled, to kick
+ * channels that may be stuck writing to a dead peer.
+ */
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         }
+        qemu_mutex_unlock(&p->mutex);
     }
-    qemu_mutex_unlock(&comp_done_lock);
+}
 
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        if (!comp_param[idx].quit) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->c) {
+            object_unref(OBJECT(p->c));
         }
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->pages);
+        g_free(p->packet);
+        g_free(p->iov);
     }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
+/* Hand the current batch to the first idle channel */
+static int multifd_send_pages(void)
 {
-    param->block = block;
-    param->offset = offset;
+    MultiFDPages *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    int i;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            p->pending_job = true;
+            p->packet_num = multifd_send_state->packet_num++;
+            multifd_send_state->pages = p->pages;
+            p->pages = pages;
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+    multifd_send_state->unsynced = true;
+    qemu_sem_post(&p->sem);
+
+    return atomic_read(&multifd_send_state->failed) ? -1 : 0;
 }
 
-static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
-                                           ram_addr_t offset,
-                                           uint64_t *bytes_transferred)
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->num && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->num++] = offset;
+    if (pages->num == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+
+    return 0;
+}
+
+/* Send out a partially filled batch; it must not outlive the RCU
+ * critical section of the caller.
+ */
+static int multifd_flush_pages(void)
+{
+    if (!multifd_send_state || !multifd_send_state->pages->num) {
+        return 0;
+    }
+    return multifd_send_pages();
+}
+
+/*
+ * Wait until every page queued so far has been written, then put a SYNC
+ * packet on each channel and the matching marker on the main stream.
+ *
+ * Returns: < 0 if a channel failed
+ */
+static int multifd_send_sync_main(QEMUFile *f)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    int i;
+
+    if (!multifd_send_state) {
+        return 0;
+    }
+    if (multifd_flush_pages() < 0) {
+        goto err;
+    }
+    if (!multifd_send_state->unsynced) {
+        return 0;
+    }
+
+    /* Taking every token means all channels are idle */
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending_job = true;
+        p->sync = true;
+        p->packet_num = multifd_send_state->packet_num++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    multifd_send_state->unsynced = false;
+    if (atomic_read(&multifd_send_state->failed)) {
+        goto err;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    bytes_transferred += 8;
+    return 0;
+
+err:
+    qemu_file_set_error(f, -EIO);
+    return -1;
+}
 
+/* Sync the channels if the dirty bitmap was synced since the last time */
+static int multifd_send_sync_round(QEMUFile *f)
+{
+    if (!multifd_send_state ||
+        multifd_send_state->sync_round == bitmap_sync_count) {
+        return 0;
+    }
+    multifd_send_state->sync_round = bitmap_sync_count;
+    return multifd_send_sync_main(f);
+}
+
+static void multifd_recv_fail(MultiFDRecvParams *p, Error *err)
+{
+    if (!atomic_xchg(&multifd_recv_state->failed, true) && err) {
+        error_reportf_err(err, "multifd channel %d: ", p->id);
+    } else {
+        error_free(err);
+    }
+}
+
+static int multifd_recv_initial_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDInit msg;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    int ret;
+
+    ret = multifd_channel_io(p->c, &iov, 1, false, errp);
+    if (ret <= 0) {
+        if (ret == 0) {
+            error_setg(errp, "multifd channel closed before its header");
+        }
+        return -1;
+    }
+    if (be32_to_cpu(msg.magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", be32_to_cpu(msg.magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    if (be32_to_cpu(msg.version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", be32_to_cpu(msg.version), MULTIFD_VERSION);
+        return -1;
+    }
+    if (msg.id >= multifd_recv_state->count) {
+        error_setg(errp, "multifd: received channel id %d, only %d channels"
+                   " configured", msg.id, multifd_recv_state->count);
+        return -1;
+    }
+    p->id = msg.id;
+
+    return 0;
+}
+
+/*
+ * Read one packet and land its pages in guest RAM.
+ *
+ * Returns 1 on success, 0 if the peer closed the channel between packets
+ * and -1 on error.
+ */
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags,
+                               Error **errp)
+{
+    MultiFDPacket *packet = p->packet;
+    struct iovec iov;
+    RAMBlock *block;
+    uint32_t num;
+    int i, ret;
+
+    iov.iov_base = packet;
+    iov.iov_len = offsetof(MultiFDPacket, offset);
+    ret = multifd_channel_io(p->c, &iov, 1, false, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x expected %x",
+                   be32_to_cpu(packet->magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    *flags = be32_to_cpu(packet->flags);
+    num = be32_to_cpu(packet->pages);
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        error_setg(errp, "multifd: received packet with %u pages, "
+                   "maximum is %d", num, MULTIFD_PAGES_PER_PACKET);
+        return -1;
+    }
+    if (!num) {
+        return 1;
+    }
+
+    iov.iov_base = packet->offset;
+    iov.iov_len = num * sizeof(uint64_t);
+    if (multifd_channel_io(p->c, &iov, 1, false, errp) <= 0) {
+        error_setg(errp, "multifd: truncated packet");
+        return -1;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        rcu_read_unlock();
+        error_setg(errp, "multifd: unknown ramblock \"%s\"",
+                   packet->ramblock);
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            !offset_in_ramblock(block, offset)) {
+            rcu_read_unlock();
+            error_setg(errp, "multifd: illegal offset " RAM_ADDR_FMT
+                       " in ramblock \"%s\"", offset, block->idstr);
+            return -1;
+        }
+        p->iov[i].iov_base = block->host + offset;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+    ret = multifd_channel_io(p->c, p->iov, num, false, errp);
+    rcu_read_unlock();
+    if (ret == 0) {
+        error_setg(errp, "multifd: truncated packet");
+        return -1;
+    }
+
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    uint32_t flags = 0;
+    int ret;
+
+    rcu_register_thread();
+
+    if (multifd_recv_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+
+    while (!atomic_read(&p->quit)) {
+        ret = multifd_recv_packet(p, &flags, &local_err);
+        if (ret <= 0) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_resume);
+        }
+    }
+
+out:
+    /* A channel going away between packets is normal once the source has
+     * finished; if it happens earlier, the next SYNC on the main stream
+     * notices the failure.
+     */
+    if (!atomic_read(&p->quit)) {
+        multifd_recv_fail(p, local_err);
+    } else {
+        error_free(local_err);
+    }
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+void multifd_load_setup(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd() || multifd_recv_state) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = thread_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_sem_init(&p->sem_resume, 0);
+        p->packet = g_new0(MultiFDPacket, 1);
+        p->iov = g_new0(struct iovec, MULTIFD_PAGES_PER_PACKET);
+    }
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    if (!multifd_recv_state) {
+        return true;
+    }
+    return multifd_recv_state->connected == multifd_recv_state->count;
+}
+
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: unexpected channel before the main stream");
+        return;
+    }
+    p = &multifd_recv_state->params[multifd_recv_state->connected++];
+    object_ref(OBJECT(ioc));
+    p->c = ioc;
+    qio_channel_set_blocking(ioc, true, NULL);
+    qemu_thread_create(&p->thread, "multifd-recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->connected; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        atomic_set(&p->quit, true);
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        qemu_sem_post(&p->sem_resume);
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (i < multifd_recv_state->connected) {
+            qemu_thread_join(&p->thread);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_sem_destroy(&p->sem_resume);
+        g_free(p->packet);
+        g_free(p->iov);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/*
+ * Called at a RAM_SAVE_FLAG_MULTIFD_SYNC marker: wait until every channel
+ * has landed all the pages sent before its SYNC packet, then let them go
+ * on with the next round.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd sync received but multifd is not enabled");
+        return -EINVAL;
+    }
+
+    /* Channels are accepted from the main loop, so let it run until all
+     * of them are there before blocking on them.
+     */
+    while (!multifd_recv_all_channels_created()) {
+        if (!qemu_in_coroutine()) {
+            error_report("multifd: not all channels connected");
+            return -EINVAL;
+        }
+        co_aio_sleep_ns(qemu_get_aio_context(), QEMU_CLOCK_REALTIME,
+                        SCALE_MS);
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->failed)) {
+        return -EIO;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_resume);
+    }
+
+    return 0;
+}
+
+/* Copy the units that @param has finished compressing to the stream */
+static void compress_collect(QEMUFile *f, CompressParam *param)
+{
+    unsigned done = atomic_mb_read(&param->done);
+
+    while (param->tail != done) {
+        CompressUnit *unit = &param->units[param->tail % COMPRESS_RING_SIZE];
+
+        if (unit->out_len < 0) {
+            qemu_file_set_error(f, -EIO);
+            error_report("compressed data failed!");
+        } else {
+            qemu_put_buffer(f, unit->out, unit->out_len);
+            bytes_transferred += unit->out_len;
+        }
+        param->tail++;
+    }
+}
+
+static void compress_submit(void)
+{
+    if (comp_open) {
+        comp_open->head++;
+        qemu_sem_post(&comp_open->sem);
+        comp_open = NULL;
+    }
+}
+
+/* Returns a compression thread with a free unit, waiting for one if all
+ * rings are full.
+ */
+static CompressParam *compress_get_param(QEMUFile *f)
+{
+    int i, idx, thread_count = migrate_compress_threads();
+
+    for (;;) {
+        /* reset first, so that a completion after the scan wakes us up */
+        qemu_event_reset(&comp_done_event);
+        for (i = 0; i < thread_count; i++) {
+            CompressParam *param;
+
+            idx = (comp_next + i) % thread_count;
+            param = &comp_param[idx];
+            compress_collect(f, param);
+            if (param->head - param->tail < COMPRESS_RING_SIZE) {
+                comp_next = (idx + 1) % thread_count;
+                return param;
+            }
+        }
+        qemu_event_wait(&comp_done_event);
+    }
+}
+
+static void flush_compressed_data(QEMUFile *f)
+{
+    int idx, thread_count;
+
+    if (!migrate_use_compression() || !comp_param) {
+        return;
+    }
     thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                comp_param[idx].done = false;
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                qemu_mutex_lock(&comp_param[idx].mutex);
-                set_compress_params(&comp_param[idx], block, offset);
-                qemu_cond_signal(&comp_param[idx].cond);
-                qemu_mutex_unlock(&comp_param[idx].mutex);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
+
+    compress_submit();
+    for (idx = 0; idx < thread_count; idx++) {
+        CompressParam *param = &comp_param[idx];
+
+        for (;;) {
+            qemu_event_reset(&comp_done_event);
+            compress_collect(f, param);
+            if (param->tail == param->head || atomic_read(&param->quit)) {
                 break;
             }
+            qemu_event_wait(&comp_done_event);
         }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+    }
+}
+
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset)
+{
+    CompressUnit *unit;
+
+    if (comp_open) {
+        unit = &comp_open->units[comp_open->head % COMPRESS_RING_SIZE];
+        if (unit->block != block) {
+            compress_submit();
         }
     }
-    qemu_mutex_unlock(&comp_done_lock);
+    if (!comp_open) {
+        comp_open = compress_get_param(f);
+        unit = &comp_open->units[comp_open->head % COMPRESS_RING_SIZE];
+        unit->block = block;
+        unit->nr_pages = 0;
+    }
 
-    return pages;
+    unit->offset[unit->nr_pages++] = offset;
+    if (unit->nr_pages == COMPRESS_UNIT_PAGES) {
+        compress_submit();
+    }
+    acct_info.norm_pages++;
+
+    return 1;
 }
 
 /**
@@ -963,8 +1800,7 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             offset |= RAM_SAVE_FLAG_CONTINUE;
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
+                pages = compress_page_with_multi_thread(f, block, offset);
             }
         }
     }
@@ -1214,6 +2050,48 @@ err:
     return -1;
 }
 
+/**
+ * ram_save_multifd_page: Queue a page on the multifd channels
+ *
+ * Zero pages still go through the main stream, everything else is sent
+ * in full by the multifd threads.
+ *
+ * Returns: Number of pages written, < 0 on error.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    pages = save_zero_page(f, block, block == last_sent_block ?
+                           offset | RAM_SAVE_FLAG_CONTINUE : offset,
+                           block->host + offset, bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
+
+    if (multifd_queue_page(block, offset) < 0) {
+        qemu_file_set_error(f, -EIO);
+        return -1;
+    }
+    /* The page does not go through @f, but must still count against the
+     * bandwidth limit and in the transfer statistics.
+     */
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
 /**
  * ram_save_target_page: Save one target page
  *
@@ -1242,6 +2120,8 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+        } else if (multifd_send_state) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1256,9 +2136,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  Pages on the multifd channels never reach the
+         * stream, ram_save_multifd_page() deals with it itself.
          */
-        if (res > 0) {
+        if (res > 0 && !multifd_send_state) {
             last_sent_block = pss->block;
         }
     }
@@ -1875,6 +2756,7 @@ err:
 static int ram_save_init_globals(void)
 {
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    bool iothread_locked;
 
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
@@ -1912,8 +2794,13 @@ static int ram_save_init_globals(void)
         acct_clear();
     }
 
-    /* For memory_global_dirty_log_start below.  */
-    qemu_mutex_lock_iothread();
+    /* For memory_global_dirty_log_start below.  Background savevm
+     * calls us from the main loop, with the lock already held.
+     */
+    iothread_locked = qemu_mutex_iothread_locked();
+    if (!iothread_locked) {
+        qemu_mutex_lock_iothread();
+    }
 
     qemu_mutex_lock_ramlist();
     rcu_read_lock();
@@ -1939,7 +2826,9 @@ static int ram_save_init_globals(void)
     memory_global_dirty_log_start();
     migration_bitmap_sync();
     qemu_mutex_unlock_ramlist();
-    qemu_mutex_unlock_iothread();
+    if (!iothread_locked) {
+        qemu_mutex_unlock_iothread();
+    }
     rcu_read_unlock();
 
     return 0;
@@ -1997,6 +2886,14 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     /* Read version before ram_list.blocks */
     smp_rmb();
 
+    /* Pages of the new dirty bitmap round must not race with the ones
+     * still in flight from the previous round.
+     */
+    if (multifd_send_sync_round(f) < 0) {
+        rcu_read_unlock();
+        return -EIO;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
@@ -2028,6 +2925,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    multifd_flush_pages();
     rcu_read_unlock();
 
     /*
@@ -2055,6 +2953,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     if (!migration_in_postcopy(migrate_get_current())) {
         migration_bitmap_sync();
     }
+    multifd_send_sync_round(f);
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -2073,6 +2972,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    multifd_send_sync_main(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2092,11 +2992,17 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     if (!migration_in_postcopy(migrate_get_current()) &&
         remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
+        bool iothread_locked = qemu_mutex_iothread_locked();
+
+        if (!iothread_locked) {
+            qemu_mutex_lock_iothread();
+        }
         rcu_read_lock();
         migration_bitmap_sync();
         rcu_read_unlock();
-        qemu_mutex_unlock_iothread();
+        if (!iothread_locked) {
+            qemu_mutex_unlock_iothread();
+        }
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
 
@@ -2203,41 +3109,46 @@ static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
     unsigned long pagesize;
-    uint8_t *des;
-    int len;
+    DecompressUnit *unit;
+    uint8_t *compbuf;
+    int i;
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->des) {
-            des = param->des;
-            len = param->len;
-            param->des = 0;
-            qemu_mutex_unlock(&param->mutex);
+    for (;;) {
+        qemu_sem_wait(&param->sem);
+        if (atomic_read(&param->quit)) {
+            break;
+        }
 
+        unit = &param->units[param->done % DECOMPRESS_RING_SIZE];
+        compbuf = unit->compbuf;
+        for (i = 0; i < unit->nr_pages; i++) {
             pagesize = TARGET_PAGE_SIZE;
             /* uncompress() will return failed in some case, especially
              * when the page is dirted when doing the compression, it's
              * not a problem because the dirty page will be retransferred
              * and uncompress() won't break the data in other pages.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
-
-            qemu_mutex_lock(&decomp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&decomp_done_cond);
-            qemu_mutex_unlock(&decomp_done_lock);
-
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+            uncompress((Bytef *)unit->host[i], &pagesize,
+                       (const Bytef *)compbuf, unit->len[i]);
+            compbuf += unit->len[i];
         }
+
+        atomic_mb_set(&param->done, param->done + 1);
+        qemu_event_set(&decomp_done_event);
     }
-    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
 
+static void decompress_submit(void)
+{
+    if (decomp_open) {
+        decomp_open->head++;
+        qemu_sem_post(&decomp_open->sem);
+        decomp_open = NULL;
+    }
+}
+
 static void wait_for_decompress_done(void)
 {
     int idx, thread_count;
@@ -2246,31 +3157,38 @@ static void wait_for_decompress_done(void)
         return;
     }
 
+    decompress_submit();
     thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
     for (idx = 0; idx < thread_count; idx++) {
-        while (!decomp_param[idx].done) {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        DecompressParam *param = &decomp_param[idx];
+
+        for (;;) {
+            qemu_event_reset(&decomp_done_event);
+            if (atomic_mb_read(&param->done) == param->head) {
+                break;
+            }
+            qemu_event_wait(&decomp_done_event);
         }
     }
-    qemu_mutex_unlock(&decomp_done_lock);
 }
 
 void migrate_decompress_threads_create(void)
 {
-    int i, thread_count;
+    int i, j, thread_count;
 
     thread_count = migrate_decompress_threads();
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
-    qemu_mutex_init(&decomp_done_lock);
-    qemu_cond_init(&decomp_done_cond);
+    qemu_event_init(&decomp_done_event, false);
+    decomp_open = NULL;
+    decomp_next = 0;
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        decomp_param[i].done = true;
-        decomp_param[i].quit = false;
+        for (j = 0; j < DECOMPRESS_RING_SIZE; j++) {
+            decomp_param[i].units[j].compbuf =
+                g_malloc0(DECOMPRESS_UNIT_PAGES *
+                          compressBound(TARGET_PAGE_SIZE));
+        }
+        qemu_sem_init(&decomp_param[i].sem, 0);
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -2279,54 +3197,75 @@ void migrate_decompress_threads_create(void)
 
 void migrate_decompress_threads_join(void)
 {
-    int i, thread_count;
+    int i, j, thread_count;
 
     thread_count = migrate_decompress_threads();
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        decomp_param[i].quit = true;
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+        atomic_set(&decomp_param[i].quit, true);
+        qemu_sem_post(&decomp_param[i].sem);
     }
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
+        qemu_sem_destroy(&decomp_param[i].sem);
+        for (j = 0; j < DECOMPRESS_RING_SIZE; j++) {
+            g_free(decomp_param[i].units[j].compbuf);
+        }
     }
+    qemu_event_destroy(&decomp_done_event);
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
     decomp_param = NULL;
+    decomp_open = NULL;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+/* Returns a decompression thread with a free unit, waiting for one if
+ * all rings are full.
+ */
+static DecompressParam *decompress_get_param(void)
 {
-    int idx, thread_count;
+    int i, idx, thread_count = migrate_decompress_threads();
 
-    thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
-                break;
+    for (;;) {
+        qemu_event_reset(&decomp_done_event);
+        for (i = 0; i < thread_count; i++) {
+            DecompressParam *param;
+
+            idx = (decomp_next + i) % thread_count;
+            param = &decomp_param[idx];
+            if (param->head - atomic_mb_read(&param->done) <
+                DECOMPRESS_RING_SIZE) {
+                decomp_next = (idx + 1) % thread_count;
+                return param;
             }
         }
-        if (idx < thread_count) {
-            break;
-        } else {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
-        }
+        qemu_event_wait(&decomp_done_event);
+    }
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f,
+                                               void *host, int len)
+{
+    DecompressUnit *unit;
+
+    if (!decomp_open) {
+        decomp_open = decompress_get_param();
+        unit = &decomp_open->units[decomp_open->head % DECOMPRESS_RING_SIZE];
+        unit->nr_pages = 0;
+        unit->used = 0;
+    } else {
+        unit = &decomp_open->units[decomp_open->head % DECOMPRESS_RING_SIZE];
+    }
+
+    qemu_get_buffer(f, unit->compbuf + unit->used, len);
+    unit->host[unit->nr_pages] = host;
+    unit->len[unit->nr_pages] = len;
+    unit->nr_pages++;
+    unit->used += len;
+
+    if (unit->nr_pages == DECOMPRESS_UNIT_PAGES) {
+        decompress_submit();
     }
-    qemu_mutex_unlock(&decomp_done_lock);
 }
 
 /*
@@ -2575,6 +3514,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
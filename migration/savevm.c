@@ -1238,7 +1238,7 @@ done:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
 
@@ -2013,26 +2013,312 @@ int qemu_loadvm_state(QEMUFile *f)
     return ret;
 }
 
+/* Fill in @sn for a snapshot of the current state called @name */
+static void savevm_init_snapshot_info(BlockDriverState *bs,
+                                      QEMUSnapshotInfo *sn, const char *name)
+{
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
+    qemu_timeval tv;
+    struct tm tm;
+
+    memset(sn, 0, sizeof(*sn));
+
+    /* fill auxiliary fields */
+    qemu_gettimeofday(&tv);
+    sn->date_sec = tv.tv_sec;
+    sn->date_nsec = tv.tv_usec * 1000;
+    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (name) {
+        if (bdrv_snapshot_find(bs, old_sn, name) >= 0) {
+            pstrcpy(sn->name, sizeof(sn->name), old_sn->name);
+            pstrcpy(sn->id_str, sizeof(sn->id_str), old_sn->id_str);
+        } else {
+            pstrcpy(sn->name, sizeof(sn->name), name);
+        }
+    } else {
+        /* cast below needed for OpenBSD where tv_sec is still 'long' */
+        localtime_r((const time_t *)&tv.tv_sec, &tm);
+        strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
+    }
+}
+
+/*
+ * Background savevm.  RAM is written to the vmstate area while the guest
+ * keeps running, using the iterative RAM code of live migration and its
+ * dirty log to catch pages that change under us.  Once a pass leaves
+ * little enough dirty RAM (or after BG_SAVEVM_MAX_PASSES passes) the
+ * guest is stopped for the remaining pages, the device state and the
+ * disk snapshots, so the snapshot describes that last instant.
+ *
+ * The stream is produced into a memory buffer in steps of at most
+ * BG_SAVEVM_CHUNK bytes and written out between steps from a coroutine,
+ * so the monitor and the main loop stay responsive.  Progress shows in
+ * query-migrate, and migrate_cancel aborts the snapshot.
+ */
+#define BG_SAVEVM_CHUNK         (16 << 20)
+#define BG_SAVEVM_MAX_PASSES    10
+
+static struct {
+    Coroutine *co;
+    QEMUBH *bh;
+    BlockDriverState *bs;
+    char *name;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    /* offset of the next flush in the vmstate area */
+    int64_t pos;
+    int ret;
+} bg_savevm;
+
+bool savevm_in_background(void)
+{
+    return bg_savevm.f != NULL;
+}
+
+/* Write out what the stream produced since the last flush */
+static int bg_savevm_flush(void)
+{
+    QIOChannelBuffer *bioc = bg_savevm.bioc;
+    int ret;
+
+    qemu_fflush(bg_savevm.f);
+    ret = qemu_file_get_error(bg_savevm.f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (bioc->usage) {
+        ret = bdrv_save_vmstate(bg_savevm.bs, bioc->data, bg_savevm.pos,
+                                bioc->usage);
+        if (ret < 0) {
+            return ret;
+        }
+        bg_savevm.pos += bioc->usage;
+        bioc->usage = 0;
+        bioc->offset = 0;
+    }
+    qemu_file_reset_rate_limit(bg_savevm.f);
+
+    return 0;
+}
+
+static void coroutine_fn bg_savevm_co(void *opaque)
+{
+    MigrationState *ms = migrate_get_current();
+    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    uint64_t pending_pre, pending_post, max_size = 0;
+    int passes = 0;
+    int ret;
+
+    qemu_savevm_state_header(bg_savevm.f);
+    qemu_savevm_state_begin(bg_savevm.f, &ms->params);
+    ret = bg_savevm_flush();
+    ms->setup_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+    migrate_set_state(&ms->state, MIGRATION_STATUS_SETUP,
+                      MIGRATION_STATUS_ACTIVE);
+
+    while (ret == 0 && ms->state == MIGRATION_STATUS_ACTIVE) {
+        int64_t elapsed;
+
+        ret = qemu_savevm_state_iterate(bg_savevm.f, false);
+        if (ret > 0) {
+            passes++;
+        }
+        ret = bg_savevm_flush();
+        if (ret < 0) {
+            break;
+        }
+
+        /* Stop once the rest can be written within the downtime limit */
+        elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
+        if (elapsed) {
+            max_size = bg_savevm.pos / elapsed *
+                       ms->parameters.downtime_limit;
+        }
+        qemu_savevm_state_pending(bg_savevm.f, max_size,
+                                  &pending_pre, &pending_post);
+        trace_savevm_background_iterate(passes, pending_pre + pending_post,
+                                        max_size);
+        if (pending_pre + pending_post <= max_size ||
+            passes >= BG_SAVEVM_MAX_PASSES) {
+            break;
+        }
+
+        /* Let the main loop run between steps */
+        co_aio_sleep_ns(qemu_get_aio_context(), QEMU_CLOCK_REALTIME, 0);
+    }
+
+    bg_savevm.ret = ret;
+    bg_savevm.co = NULL;
+    qemu_bh_schedule(bg_savevm.bh);
+}
+
+/* Stop the guest and finish the snapshot, outside of coroutine context */
+static void bg_savevm_complete(void *opaque)
+{
+    MigrationState *ms = migrate_get_current();
+    QEMUSnapshotInfo sn;
+    BlockDriverState *bs = bg_savevm.bs, *bs1;
+    Error *local_err = NULL;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    int saved_vm_running = runstate_is_running();
+    int64_t stop_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int ret = bg_savevm.ret;
+
+    qemu_bh_delete(bg_savevm.bh);
+    bg_savevm.bh = NULL;
+
+    if (ret == 0 && ms->state != MIGRATION_STATUS_ACTIVE) {
+        ret = -ECANCELED;
+    }
+    if (ret == 0 && global_state_store()) {
+        error_report("Error saving global state");
+        ret = -EINVAL;
+    }
+    if (ret == 0) {
+        vm_stop(RUN_STATE_SAVE_VM);
+
+        aio_context_acquire(aio_context);
+        qemu_file_set_rate_limit(bg_savevm.f, 0);
+        qemu_savevm_state_complete_precopy(bg_savevm.f, false);
+        ret = bg_savevm_flush();
+        if (ret == 0) {
+            ret = bdrv_flush(bs);
+        }
+        if (ret < 0) {
+            error_report("Error while writing VM state: %s", strerror(-ret));
+        } else if (bg_savevm.name &&
+                   bdrv_all_delete_snapshot(bg_savevm.name, &bs1,
+                                            &local_err) < 0) {
+            /* The old snapshot is only replaced once the new one is safe */
+            error_reportf_err(local_err,
+                              "Error while deleting snapshot on device '%s': ",
+                              bdrv_get_device_name(bs1));
+            ret = -EIO;
+        } else {
+            savevm_init_snapshot_info(bs, &sn, bg_savevm.name);
+            ret = bdrv_all_create_snapshot(&sn, bs, bg_savevm.pos, &bs);
+            if (ret < 0) {
+                error_report("Error while creating snapshot on '%s'",
+                             bdrv_get_device_name(bs));
+            }
+        }
+        aio_context_release(aio_context);
+
+        ms->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - stop_time;
+        if (saved_vm_running) {
+            vm_start();
+        }
+    } else if (ret != -ECANCELED) {
+        error_report("Error while writing VM state: %s", strerror(-ret));
+    }
+
+    qemu_savevm_state_cleanup();
+    qemu_fclose(bg_savevm.f);
+    ms->to_dst_file = NULL;
+    ms->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - ms->total_time;
+    trace_savevm_background_complete(ret, bg_savevm.pos);
+
+    if (ms->state == MIGRATION_STATUS_CANCELLING) {
+        migrate_set_state(&ms->state, MIGRATION_STATUS_CANCELLING,
+                          MIGRATION_STATUS_CANCELLED);
+    } else {
+        migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
+                          ret == 0 ? MIGRATION_STATUS_COMPLETED
+                                   : MIGRATION_STATUS_FAILED);
+    }
+
+    bdrv_unref(bg_savevm.bs);
+    g_free(bg_savevm.name);
+    memset(&bg_savevm, 0, sizeof(bg_savevm));
+}
+
+/* Start a background snapshot called @name whose VM state goes to @bs */
+static void savevm_start_background(BlockDriverState *bs, const char *name,
+                                    Error **errp)
+{
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    MigrationState *ms;
+
+    if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+        error_setg(errp, "Background snapshots are not supported for "
+                   "devices in an I/O thread");
+        return;
+    }
+    if (!migration_is_idle()) {
+        error_setg(errp, "Cannot take a background snapshot during "
+                   "migration");
+        return;
+    }
+    if (migration_is_blocked(errp)) {
+        return;
+    }
+
+    /* RAM saving takes over the dirty log */
+    fast_snapshot_drop();
+
+    ms = migrate_init(&params);
+
+    /* Keep @bs around while the coroutine yields between steps */
+    bdrv_ref(bs);
+    bg_savevm.bs = bs;
+    bg_savevm.name = g_strdup(name);
+    bg_savevm.bioc = qio_channel_buffer_new(BG_SAVEVM_CHUNK);
+    qio_channel_set_name(QIO_CHANNEL(bg_savevm.bioc), "savevm-buffer");
+    bg_savevm.f = qemu_fopen_channel_output(QIO_CHANNEL(bg_savevm.bioc));
+    object_unref(OBJECT(bg_savevm.bioc));
+    qemu_file_set_rate_limit(bg_savevm.f, BG_SAVEVM_CHUNK);
+    ms->to_dst_file = bg_savevm.f;
+
+    bg_savevm.bh = qemu_bh_new(bg_savevm_complete, NULL);
+    bg_savevm.co = qemu_coroutine_create(bg_savevm_co, NULL);
+    qemu_coroutine_enter(bg_savevm.co);
+}
+
 void hmp_savevm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
     int ret;
     QEMUFile *f;
     int saved_vm_running;
     uint64_t vm_state_size;
-    qemu_timeval tv;
-    struct tm tm;
     const char *name = qdict_get_try_str(qdict, "name");
+    bool background = qdict_get_try_bool(qdict, "background", false);
     Error *local_err = NULL;
     AioContext *aio_context;
 
+    if (savevm_in_background()) {
+        monitor_printf(mon, "A background snapshot is in progress\n");
+        return;
+    }
+
     if (!bdrv_all_can_snapshot(&bs)) {
         monitor_printf(mon, "Device '%s' is writable but does not "
                        "support snapshots.\n", bdrv_get_device_name(bs));
         return;
     }
 
+    bs = bdrv_all_find_vmstate_bs();
+    if (bs == NULL) {
+        monitor_printf(mon, "No block device can accept snapshots\n");
+        return;
+    }
+    aio_context = bdrv_get_aio_context(bs);
+
+    /* A background snapshot replaces the old one when it completes */
+    if (background) {
+        savevm_start_background(bs, name, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+        }
+        return;
+    }
+
     /* Delete old snapshots of the same name */
     if (name && bdrv_all_delete_snapshot(name, &bs1, &local_err) < 0) {
         error_reportf_err(local_err,
@@ -2041,12 +2327,8 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    bs = bdrv_all_find_vmstate_bs();
-    if (bs == NULL) {
-        monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
-    }
-    aio_context = bdrv_get_aio_context(bs);
+    /* RAM saving takes over the dirty log */
+    fast_snapshot_drop();
 
     saved_vm_running = runstate_is_running();
 
@@ -2059,27 +2341,7 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
 
     aio_context_acquire(aio_context);
 
-    memset(sn, 0, sizeof(*sn));
-
-    /* fill auxiliary fields */
-    qemu_gettimeofday(&tv);
-    sn->date_sec = tv.tv_sec;
-    sn->date_nsec = tv.tv_usec * 1000;
-    sn->vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-
-    if (name) {
-        ret = bdrv_snapshot_find(bs, old_sn, name);
-        if (ret >= 0) {
-            pstrcpy(sn->name, sizeof(sn->name), old_sn->name);
-            pstrcpy(sn->id_str, sizeof(sn->id_str), old_sn->id_str);
-        } else {
-            pstrcpy(sn->name, sizeof(sn->name), name);
-        }
-    } else {
-        /* cast below needed for OpenBSD where tv_sec is still 'long' */
-        localtime_r((const time_t *)&tv.tv_sec, &tm);
-        strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
-    }
+    savevm_init_snapshot_info(bs, sn, name);
 
     /* save the VM state */
     f = qemu_fopen_bdrv(bs, 1);
@@ -2176,6 +2438,10 @@ int load_vmstate(const char *name)
     int ret;
     AioContext *aio_context;
 
+    if (savevm_in_background()) {
+        error_report("A background snapshot is in progress");
+        return -EBUSY;
+    }
     if (!bdrv_all_can_snapshot(&bs)) {
         error_report("Device '%s' is writable but does not support snapshots.",
                      bdrv_get_device_name(bs));
@@ -2224,6 +2490,9 @@ int load_vmstate(const char *name)
         return -EINVAL;
     }
 
+    /* RAM is about to be rewritten behind the dirty log's back */
+    fast_snapshot_drop();
+
     qemu_system_reset(VMRESET_SILENT);
     migration_incoming_state_new(f);
 
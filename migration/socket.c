@@ -55,6 +55,31 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the current outgoing migration, kept so that the multifd
+ * channels can connect to the same destination as the main stream.
+ */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "multifd channels require a socket migration");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-outgoing");
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+
+    return QIO_CHANNEL(sioc);
+}
+
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -106,7 +131,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -147,10 +173,27 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
+    if (migrate_use_multifd() && !multifd_recv_all_channels_created()) {
+        /* The main stream is always the first connection */
+        qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-incoming");
+        multifd_recv_new_channel(QIO_CHANNEL(sioc));
+        object_unref(OBJECT(sioc));
+        if (!multifd_recv_all_channels_created()) {
+            return TRUE; /* keep listening for the other channels */
+        }
+        goto out;
+    }
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-incoming");
+    if (migrate_use_multifd()) {
+        multifd_load_setup();
+    }
     migration_channel_process_incoming(migrate_get_current(),
                                        QIO_CHANNEL(sioc));
     object_unref(OBJECT(sioc));
+    if (!multifd_recv_all_channels_created()) {
+        return TRUE; /* keep listening for the multifd channels */
+    }
 
 out:
     /* Close listening socket as its no longer needed */
@@ -162,8 +205,15 @@ out:
 static void socket_start_incoming_migration(SocketAddress *saddr,
                                             Error **errp)
 {
-    QIOChannelSocket *listen_ioc = qio_channel_socket_new();
+    QIOChannelSocket *listen_ioc;
+
+    if (migrate_use_multifd() && migrate_get_current()->parameters.tls_creds) {
+        error_setg(errp, "multifd is not supported with TLS");
+        qapi_free_SocketAddress(saddr);
+        return;
+    }
 
+    listen_ioc = qio_channel_socket_new();
     qio_channel_set_name(QIO_CHANNEL(listen_ioc),
                          "migration-socket-listener");
 
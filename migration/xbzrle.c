@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,46 +25,97 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/*
+ * The encoder alternates between two scans, both starting at offset @i:
+ * the zrun scan returns the offset of the first byte that differs between
+ * the two pages, and the nzrun scan the offset of the first byte that is
+ * the same.  The vector versions below only replace these scans.
+ */
+typedef uint32_t (*xbzrle_scan_fn)(const uint8_t *old_buf,
+                                   const uint8_t *new_buf,
+                                   uint32_t i, uint32_t slen);
+
+static uint32_t xbzrle_zrun_int(const uint8_t *old_buf,
+                                const uint8_t *new_buf,
+                                uint32_t i, uint32_t slen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    /* not aligned to sizeof(long) */
+    uint32_t res = (slen - i) % sizeof(long);
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
 
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
             i++;
-            res--;
         }
+    }
 
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+    return i;
+}
+
+static uint32_t xbzrle_nzrun_int(const uint8_t *old_buf,
+                                 const uint8_t *new_buf,
+                                 uint32_t i, uint32_t slen)
+{
+    /* not aligned to sizeof(long) */
+    uint32_t res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
                 i += sizeof(long);
-                zrun_len += sizeof(long);
             }
+        }
+    }
 
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
+    return i;
+}
+
+static inline int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen,
+                                xbzrle_scan_fn zrun, xbzrle_scan_fn nzrun)
+{
+    uint32_t zrun_len, nzrun_len, end;
+    int d = 0, i = 0;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
         }
 
+        end = zrun(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
+
         /* buffer unchanged */
         if (zrun_len == slen) {
             return 0;
@@ -76,56 +128,355 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = nzrun(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = end;
     }
 
     return d;
 }
 
+static int xbzrle_encode_int(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_int, xbzrle_nzrun_int);
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Compare 16 bytes at a time; bit N of the movemask is set when byte N
+ * is the same in both pages.
+ */
+static uint32_t xbzrle_zrun_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf,
+                                 uint32_t i, uint32_t slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+        i += 16;
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static uint32_t xbzrle_nzrun_sse2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf,
+                                  uint32_t i, uint32_t slen)
+{
+    while (i + 16 <= slen) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 16;
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_sse2, xbzrle_nzrun_sse2);
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/* Note that due to restrictions/bugs wrt __builtin functions in gcc <= 4.8,
+ * the includes have to be within the corresponding push_options region, and
+ * therefore the regions themselves have to be ordered with increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint32_t xbzrle_zrun_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf,
+                                 uint32_t i, uint32_t slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != UINT32_MAX) {
+            return i + ctz32(~eq);
+        }
+        i += 32;
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static uint32_t xbzrle_nzrun_avx2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf,
+                                  uint32_t i, uint32_t slen)
+{
+    while (i + 32 <= slen) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+        i += 32;
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_avx2, xbzrle_nzrun_avx2);
+}
+
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+
+static uint32_t xbzrle_zrun_avx512(const uint8_t *old_buf,
+                                   const uint8_t *new_buf,
+                                   uint32_t i, uint32_t slen)
+{
+    while (i + 64 <= slen) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (eq != UINT64_MAX) {
+            return i + ctz64(~eq);
+        }
+        i += 64;
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static uint32_t xbzrle_nzrun_avx512(const uint8_t *old_buf,
+                                    const uint8_t *new_buf,
+                                    uint32_t i, uint32_t slen)
+{
+    while (i + 64 <= slen) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+        i += 64;
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_avx512, xbzrle_nzrun_avx512);
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+#define CACHE_SSE2     4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support <cpuid.h>.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int)
+    = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) = xbzrle_encode_int;
+
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_avx2;
+    }
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_avx512;
+    }
+#endif
+#endif
+    encode_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+
+#ifndef bit_AVX512F
+#define bit_AVX512F (1 << 16)
+#endif
+#ifndef bit_AVX512BW
+#define bit_AVX512BW (1 << 30)
+#endif
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* ... and for AVX-512 that the OS saves the opmask and
+             * upper ZMM state too.
+             */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *xbzrle_encode_accel_name(void)
+{
+#ifdef CONFIG_AVX2_OPT
+#ifdef CONFIG_AVX512BW_OPT
+    if (encode_accel == xbzrle_encode_avx512) {
+        return "avx512bw";
+    }
+#endif
+    if (encode_accel == xbzrle_encode_avx2) {
+        return "avx2";
+    }
+#endif
+    if (encode_accel == xbzrle_encode_sse2) {
+        return "sse2";
+    }
+    return "int";
+}
+
+#else
+#define encode_accel xbzrle_encode_int
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+
+const char *xbzrle_encode_accel_name(void)
+{
+    return "int";
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -67,6 +67,7 @@
 #endif
 #include "exec/memory.h"
 #include "exec/exec-all.h"
+#include "sysemu/memory_mapping.h"
 #include "qemu/log.h"
 #include "qmp-commands.h"
 #include "hmp.h"
@@ -1772,6 +1773,86 @@ void qmp_getfd(const char *fdname, Error **errp)
     QLIST_INSERT_HEAD(&cur_mon->fds, monfd, next);
 }
 
+static GuestMemoryBlockList *export_guest_memory_block(GuestMemoryExport *exp,
+                                                       RAMBlock *rb, int *fds,
+                                                       int *nfds)
+{
+    GuestMemoryBlockList *elem;
+    GuestMemoryBlock *info;
+
+    for (elem = exp->blocks; elem; elem = elem->next) {
+        if (!strcmp(elem->value->id, qemu_ram_get_idstr(rb))) {
+            return elem;
+        }
+    }
+
+    info = g_new0(GuestMemoryBlock, 1);
+    info->id = g_strdup(qemu_ram_get_idstr(rb));
+    info->size = qemu_ram_get_used_length(rb);
+    if (qemu_ram_get_fd(rb) >= 0 && qemu_ram_is_shared(rb)) {
+        info->has_fd_index = true;
+        info->fd_index = *nfds;
+        fds[(*nfds)++] = qemu_ram_get_fd(rb);
+    }
+
+    elem = g_new0(GuestMemoryBlockList, 1);
+    elem->value = info;
+    elem->next = exp->blocks;
+    exp->blocks = elem;
+    return elem;
+}
+
+GuestMemoryExport *qmp_export_guest_memory(Error **errp)
+{
+    GuestMemoryExport *exp = g_new0(GuestMemoryExport, 1);
+    GuestPhysBlockList guest_phys_blocks;
+    GuestPhysBlock *block;
+    GuestMemoryRangeList **next_range = &exp->ranges;
+    GuestMemoryRangeList *elem;
+    GuestMemoryRange *range;
+    RAMBlock *rb;
+    ram_addr_t offset;
+    int *fds;
+    int nfds = 0;
+
+    guest_phys_blocks_init(&guest_phys_blocks);
+    guest_phys_blocks_append(&guest_phys_blocks);
+
+    /* at most one descriptor per guest physical block */
+    fds = g_new(int, guest_phys_blocks.num);
+
+    QTAILQ_FOREACH(block, &guest_phys_blocks.head, next) {
+        rb = qemu_ram_block_from_host(block->host_addr, false, &offset);
+        if (!rb) {
+            continue;
+        }
+        export_guest_memory_block(exp, rb, fds, &nfds);
+
+        range = g_new0(GuestMemoryRange, 1);
+        range->start = block->target_start;
+        range->length = block->target_end - block->target_start;
+        range->block = g_strdup(qemu_ram_get_idstr(rb));
+        range->offset = offset;
+
+        elem = g_new0(GuestMemoryRangeList, 1);
+        elem->value = range;
+        *next_range = elem;
+        next_range = &elem->next;
+    }
+    guest_phys_blocks_free(&guest_phys_blocks);
+
+    /* the descriptors travel with the reply, which is written next */
+    if (nfds && qemu_chr_fe_set_msgfds(&cur_mon->chr, fds, nfds) < 0) {
+        error_setg(errp, "Monitor does not support passing file descriptors, "
+                   "use a UNIX socket");
+        qapi_free_GuestMemoryExport(exp);
+        exp = NULL;
+    }
+
+    g_free(fds);
+    return exp;
+}
+
 void qmp_closefd(const char *fdname, Error **errp)
 {
     mon_fd_t *monfd;
@@ -94,7 +94,7 @@ static ssize_t drop_sync(QIOChannel *ioc, size_t size)
     char small[1024];
     char *buffer;
 
-    buffer = sizeof(small) < size ? small : g_malloc(MIN(65536, size));
+    buffer = sizeof(small) >= size ? small : g_malloc(MIN(65536, size));
     while (size > 0) {
         ssize_t count = read_sync(ioc, buffer, MIN(65536, size));
 
@@ -395,6 +395,128 @@ static int nbd_receive_query_exports(QIOChannel *ioc,
     }
 }
 
+/* Request structured replies.  Return 1 if the server agreed, 0 if it
+ * does not support them, or -1 with errp set if it is impossible to
+ * continue. */
+static int nbd_request_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    nbd_opt_reply reply;
+    int error;
+
+    TRACE("Requesting structured replies");
+    if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0) {
+        return -1;
+    }
+    if (nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY, &reply,
+                                 errp) < 0) {
+        return -1;
+    }
+    error = nbd_handle_reply_err(ioc, &reply, errp);
+    if (error <= 0) {
+        return error;
+    }
+
+    if (reply.type != NBD_REP_ACK || reply.length != 0) {
+        error_setg(errp, "Unexpected reply type %" PRIx32 " with length %"
+                   PRIu32 " to structured reply request",
+                   reply.type, reply.length);
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+    return 1;
+}
+
+/* Select the "base:allocation" metadata context for export @name, so
+ * that NBD_CMD_BLOCK_STATUS can be used.  Return 0 if successful, even
+ * if the server did not select the context, or -1 with errp set if it
+ * is impossible to continue. */
+static int nbd_negotiate_base_allocation(QIOChannel *ioc, const char *name,
+                                         NBDExportInfo *info, Error **errp)
+{
+    const char *context = NBD_META_BASE_ALLOCATION;
+    size_t name_len = strlen(name);
+    size_t context_len = strlen(context);
+    uint32_t len = 4 + name_len + 4 + 4 + context_len;
+    char *data = g_malloc(len);
+    char *p = data;
+    nbd_opt_reply reply;
+    char buf[NBD_MAX_NAME_SIZE + 1];
+    uint32_t id;
+    int error;
+
+    /* Option payload:
+        [ 0 ..  3]   export name length
+        ...          export name
+        [ 0 ..  3]   number of queries (1)
+        [ 0 ..  3]   query length
+        ...          query
+     */
+    stl_be_p(p, name_len);
+    memcpy(p += 4, name, name_len);
+    stl_be_p(p += name_len, 1);
+    stl_be_p(p += 4, context_len);
+    memcpy(p += 4, context, context_len);
+
+    TRACE("Requesting metadata context '%s'", context);
+    error = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, len, data,
+                                    errp);
+    g_free(data);
+    if (error < 0) {
+        return -1;
+    }
+
+    while (1) {
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT, &reply,
+                                     errp) < 0) {
+            return -1;
+        }
+        error = nbd_handle_reply_err(ioc, &reply, errp);
+        if (error <= 0) {
+            return error;
+        }
+
+        if (reply.type == NBD_REP_ACK) {
+            if (reply.length != 0) {
+                error_setg(errp, "length too long for option end");
+                nbd_send_opt_abort(ioc);
+                return -1;
+            }
+            return 0;
+        } else if (reply.type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " expected %x",
+                       reply.type, NBD_REP_META_CONTEXT);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+
+        if (reply.length <= sizeof(id) ||
+            reply.length - sizeof(id) >= sizeof(buf)) {
+            error_setg(errp, "incorrect option length %" PRIu32,
+                       reply.length);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        len = reply.length - sizeof(id);
+        if (read_sync(ioc, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(ioc, buf, len) != len) {
+            error_setg(errp, "failed to read metadata context");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        buf[len] = '\0';
+        if (strcmp(buf, context)) {
+            error_setg(errp, "Unexpected metadata context '%s'", buf);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        info->base_allocation = true;
+        info->meta_base_allocation_id = be32_to_cpu(id);
+        TRACE("Metadata context '%s' has id %" PRIu32, context,
+              info->meta_base_allocation_id);
+    }
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -457,7 +579,7 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExportInfo *info, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
@@ -472,6 +594,9 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    if (info) {
+        memset(info, 0, sizeof(*info));
+    }
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -565,6 +690,20 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+            /* Options for structured replies must come before
+             * NBD_OPT_EXPORT_NAME, which ends the negotiation */
+            if (info) {
+                int ret = nbd_request_structured_reply(ioc, errp);
+
+                if (ret < 0) {
+                    goto fail;
+                }
+                info->structured_reply = ret > 0;
+                if (info->structured_reply &&
+                    nbd_negotiate_base_allocation(ioc, name, info, errp) < 0) {
+                    goto fail;
+                }
+            }
         }
         /* write the export name request */
         if (nbd_send_option_request(ioc, NBD_OPT_EXPORT_NAME, -1, name,
@@ -773,27 +912,63 @@ ssize_t nbd_send_request(QIOChannel *ioc, NBDRequest *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = ldl_be_p(buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The header is longer than a simple reply; the rest of it is
+         * normally already here, but wait for it if it is not. */
+        do {
+            ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                            sizeof(buf) - NBD_REPLY_SIZE);
+            if (ret == -EAGAIN) {
+                qio_channel_wait(ioc, G_IO_IN);
+            }
+        } while (ret == -EAGAIN);
+        if (ret != sizeof(buf) - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE, ...)
+           [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+           [ 8 .. 15]    handle
+           [16 .. 19]    length  (of the payload that follows)
+         */
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got structured reply: { .flags = %" PRIx16 ", .type = %" PRIu16
+              ", handle = %" PRIu64 ", .length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = ldl_be_p(buf);
+    reply->structured = false;
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
@@ -815,3 +990,57 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, NBDReply *reply)
     return 0;
 }
 
+
+/* Consume the payload of a structured reply chunk that the caller does not
+ * handle itself, and set reply->error.  Error chunks carry the error code
+ * that is reported; chunks of any other type are unexpected and result in
+ * EIO.  Return 0 if the payload was consumed, or -errno if the stream
+ * cannot be trusted anymore. */
+int nbd_receive_error_chunk(QIOChannel *ioc, NBDReply *reply)
+{
+    uint8_t buf[4 + 2];
+    uint32_t len = reply->length;
+    uint32_t error;
+    uint16_t msg_len;
+    char *msg;
+
+    if (!nbd_reply_type_is_error(reply->type)) {
+        LOG("unexpected reply chunk type %" PRIu16, reply->type);
+        reply->error = EIO;
+        return drop_sync(ioc, len) == len ? 0 : -EIO;
+    }
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length
+       ...           message
+       ...           type-specific data (e.g. offset)
+     */
+    if (len < sizeof(buf)) {
+        LOG("error chunk too short (%" PRIu32 " bytes)", len);
+        return -EINVAL;
+    }
+    if (read_sync(ioc, buf, sizeof(buf)) != sizeof(buf)) {
+        return -EIO;
+    }
+    len -= sizeof(buf);
+    error = ldl_be_p(buf);
+    msg_len = lduw_be_p(buf + 4);
+    if (error == 0 || msg_len > len) {
+        LOG("invalid error chunk");
+        return -EINVAL;
+    }
+
+    msg = g_malloc(msg_len + 1);
+    if (read_sync(ioc, msg, msg_len) != msg_len) {
+        g_free(msg);
+        return -EIO;
+    }
+    msg[msg_len] = '\0';
+    TRACE("Server reported error %" PRIu32 ": %s", error, msg);
+    g_free(msg);
+    len -= msg_len;
+
+    reply->error = nbd_errno_to_system_errno(error);
+    return drop_sync(ioc, len) == len ? 0 : -EIO;
+}
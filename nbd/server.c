@@ -84,6 +84,8 @@ struct NBDClient {
     void (*close)(NBDClient *client);
 
     bool no_zeroes;
+    bool structured_reply;
+    bool base_allocation; /* "base:allocation" metadata context selected */
     NBDExport *exp;
     QCryptoTLSCreds *tlscreds;
     char *tlsaclname;
@@ -104,6 +106,12 @@ struct NBDClient {
 
 /* That's all folks */
 
+/* The only metadata context we know about */
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Maximum number of extents in a NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 1024
+
 static void nbd_set_handlers(NBDClient *client);
 static void nbd_unset_handlers(NBDClient *client);
 static void nbd_update_can_read(NBDClient *client);
@@ -365,6 +373,162 @@ fail:
     return rc;
 }
 
+/* Handle NBD_OPT_STRUCTURED_REPLY.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          NBD_OPT_STRUCTURED_REPLY,
+                                          "OPT_STRUCTURED_REPLY should not "
+                                          "have length");
+    }
+
+    TRACE("Client supports structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+/* Read a 32-bit field out of an option payload with *length bytes left.
+ * Return -EINVAL if the payload is too short, -EIO on read failure and
+ * 0 on success. */
+static int nbd_negotiate_read_u32(QIOChannel *ioc, uint32_t *length,
+                                  uint32_t *val)
+{
+    if (*length < sizeof(*val)) {
+        return -EINVAL;
+    }
+    if (nbd_negotiate_read(ioc, val, sizeof(*val)) != sizeof(*val)) {
+        LOG("read failed");
+        return -EIO;
+    }
+    *length -= sizeof(*val);
+    be32_to_cpus(val);
+    return 0;
+}
+
+/* Process NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The
+ * only context we know about is "base:allocation"; it is listed when
+ * it is queried by name or by its namespace, or when the query list is
+ * empty for NBD_OPT_LIST_META_CONTEXT.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_handle_meta_context(NBDClient *client, uint32_t opt,
+                                             uint32_t length)
+{
+    const char *context = NBD_META_BASE_ALLOCATION;
+    char buf[NBD_MAX_NAME_SIZE + 1];
+    uint32_t len, nb_queries, i, id;
+    bool base_allocation = false;
+    int ret;
+
+    /* Client sends:
+        [ 0 ..  3]   export name length
+        ...          export name
+        [ 0 ..  3]   number of queries
+        [ 0 ..  3]   query length
+        ...          query
+        ...          more queries
+     */
+    if (!client->structured_reply) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          opt, "Structured replies were not "
+                                          "negotiated");
+    }
+
+    ret = nbd_negotiate_read_u32(client->ioc, &length, &len);
+    if (ret == -EINVAL || (ret == 0 && (len > length || len >= sizeof(buf)))) {
+        goto invalid;
+    } else if (ret < 0) {
+        return ret;
+    }
+    if (nbd_negotiate_read(client->ioc, buf, len) != len) {
+        LOG("read failed");
+        return -EIO;
+    }
+    length -= len;
+    buf[len] = '\0';
+    if (!nbd_export_find(buf)) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN,
+                                          opt, "Export '%s' not present",
+                                          buf);
+    }
+
+    ret = nbd_negotiate_read_u32(client->ioc, &length, &nb_queries);
+    if (ret == -EINVAL) {
+        goto invalid;
+    } else if (ret < 0) {
+        return ret;
+    }
+    if (nb_queries == 0 && opt == NBD_OPT_LIST_META_CONTEXT) {
+        base_allocation = true;
+    }
+    for (i = 0; i < nb_queries; i++) {
+        ret = nbd_negotiate_read_u32(client->ioc, &length, &len);
+        if (ret == -EINVAL || (ret == 0 && len > length)) {
+            goto invalid;
+        } else if (ret < 0) {
+            return ret;
+        }
+        length -= len;
+        if (len >= sizeof(buf)) {
+            if (nbd_negotiate_drop_sync(client->ioc, len) != len) {
+                return -EIO;
+            }
+            continue;
+        }
+        if (nbd_negotiate_read(client->ioc, buf, len) != len) {
+            LOG("read failed");
+            return -EIO;
+        }
+        buf[len] = '\0';
+        TRACE("Client queried metadata context '%s'", buf);
+        if (!strcmp(buf, context) ||
+            (opt == NBD_OPT_LIST_META_CONTEXT && !strcmp(buf, "base:"))) {
+            base_allocation = true;
+        }
+    }
+    if (length) {
+        goto invalid;
+    }
+
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->base_allocation = base_allocation;
+    }
+    if (base_allocation) {
+        len = strlen(context);
+        ret = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT,
+                                         opt, sizeof(id) + len);
+        if (ret < 0) {
+            return ret;
+        }
+        id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+        if (nbd_negotiate_write(client->ioc, &id, sizeof(id)) != sizeof(id) ||
+            nbd_negotiate_write(client->ioc, context, len) != len) {
+            LOG("write failed (metadata context)");
+            return -EIO;
+        }
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                      "Invalid metadata context request");
+}
+
 /* Handle NBD_OPT_STARTTLS. Return NULL to drop connection, or else the
  * new channel for all further (now-encrypted) communication. */
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
@@ -554,6 +718,22 @@ static int nbd_negotiate_options(NBDClient *client)
             case NBD_OPT_EXPORT_NAME:
                 return nbd_negotiate_handle_export_name(client, length);
 
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             case NBD_OPT_STARTTLS:
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
                     return -EIO;
@@ -1067,6 +1247,236 @@ static ssize_t nbd_co_send_reply(NBDRequestData *req, NBDReply *reply,
     return rc;
 }
 
+/* Send a structured reply chunk, whose payload is made of @head (the
+ * type-specific fields) followed by @data_len bytes from @data. */
+static int nbd_co_send_chunk(NBDClient *client, uint64_t handle,
+                             uint16_t flags, uint16_t type,
+                             void *head, size_t head_len,
+                             void *data, size_t data_len)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = head, .iov_len = head_len },
+        { .iov_base = data, .iov_len = data_len },
+    };
+    size_t len = sizeof(buf) + head_len + data_len;
+    ssize_t ret;
+
+    TRACE("Sending structured reply chunk: { .flags = %" PRIx16
+          ", .type = %" PRIu16 ", handle = %" PRIu64 ", .length = %zu }",
+          flags, type, handle, head_len + data_len);
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE, ...)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length  (of the payload that follows)
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, head_len + data_len);
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    ret = nbd_wr_syncv(client->ioc, iov, ARRAY_SIZE(iov), len, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret == len ? 0 : -EIO;
+}
+
+/* Terminate a structured reply with a NBD_REPLY_TYPE_ERROR chunk */
+static int nbd_co_send_error_chunk(NBDClient *client, uint64_t handle,
+                                   int error)
+{
+    uint8_t head[4 + 2];
+
+    stl_be_p(head, system_errno_to_nbd_errno(error));
+    stw_be_p(head + 4, 0);
+    return nbd_co_send_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, head, sizeof(head),
+                             NULL, 0);
+}
+
+/* Read [@pos, @pos + @len) of the request into req->data and send it as
+ * a NBD_REPLY_TYPE_OFFSET_DATA chunk.
+ *
+ * Returns 1 if the read failed and the reply was terminated with an error
+ * chunk, in which case no further chunks may be sent for the request. */
+static int nbd_co_send_data_chunk(NBDRequestData *req, NBDRequest *request,
+                                  uint32_t pos, uint32_t len, uint16_t flags)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    uint8_t head[8];
+    int ret;
+
+    ret = blk_pread(exp->blk, request->from + exp->dev_offset + pos,
+                    req->data + pos, len);
+    if (ret < 0) {
+        LOG("reading from file failed");
+        ret = nbd_co_send_error_chunk(client, request->handle, -ret);
+        return ret < 0 ? ret : 1;
+    }
+
+    stq_be_p(head, request->from + pos);
+    return nbd_co_send_chunk(client, request->handle, flags,
+                             NBD_REPLY_TYPE_OFFSET_DATA, head, sizeof(head),
+                             req->data + pos, len);
+}
+
+/* Answer NBD_CMD_READ with structured replies.  Ranges that are known to
+ * read as zeroes are sent as NBD_REPLY_TYPE_OFFSET_HOLE chunks, so only
+ * the allocated data is read and goes over the wire. */
+static int nbd_co_send_sparse_read(NBDRequestData *req, NBDRequest *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint32_t pos = 0, data_pos = 0;
+    uint8_t head[8 + 4];
+    int ret;
+
+    /* Block status has sector granularity; an unaligned export offset
+     * would leave nothing to query, so just send data. */
+    while (pos < request->len &&
+           !(exp->dev_offset & (BDRV_SECTOR_SIZE - 1))) {
+        uint64_t offset = request->from + exp->dev_offset + pos;
+        uint32_t len = request->len - pos;
+        BlockDriverState *file;
+        int64_t status = 0;
+        int pnum;
+
+        if (!(offset & (BDRV_SECTOR_SIZE - 1)) && len >= BDRV_SECTOR_SIZE) {
+            status = bdrv_get_block_status_above(bs, NULL,
+                                                 offset >> BDRV_SECTOR_BITS,
+                                                 len >> BDRV_SECTOR_BITS,
+                                                 &pnum, &file);
+            if (status >= 0 && pnum > 0) {
+                len = (uint32_t)pnum << BDRV_SECTOR_BITS;
+            } else {
+                status = 0;
+            }
+        }
+        if (!(status & BDRV_BLOCK_ZERO)) {
+            /* Extend the pending run of data up to the next hole */
+            pos += len;
+            continue;
+        }
+
+        if (data_pos < pos) {
+            ret = nbd_co_send_data_chunk(req, request, data_pos,
+                                         pos - data_pos, 0);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+
+        stq_be_p(head, request->from + pos);
+        stl_be_p(head + 8, len);
+        pos += len;
+        data_pos = pos;
+        ret = nbd_co_send_chunk(client, request->handle,
+                                pos == request->len ? NBD_REPLY_FLAG_DONE : 0,
+                                NBD_REPLY_TYPE_OFFSET_HOLE,
+                                head, sizeof(head), NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (data_pos < request->len) {
+        return nbd_co_send_data_chunk(req, request, data_pos,
+                                      request->len - data_pos,
+                                      NBD_REPLY_FLAG_DONE);
+    } else if (request->len == 0) {
+        return nbd_co_send_chunk(client, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+    return 0;
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS for the "base:allocation" context */
+static int nbd_co_send_block_status(NBDRequestData *req, NBDRequest *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t offset = request->from + exp->dev_offset;
+    uint64_t end = offset + request->len;
+    unsigned int max_extents, nb_extents = 0, i;
+    NBDExtent *extents;
+    uint8_t head[4];
+    int ret = 0;
+
+    max_extents = request->flags & NBD_CMD_FLAG_REQ_ONE ?
+                  1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    extents = g_new(NBDExtent, max_extents);
+
+    while (offset < end) {
+        int64_t sector_num = offset >> BDRV_SECTOR_BITS;
+        uint64_t skip = offset & (BDRV_SECTOR_SIZE - 1);
+        int nb_sectors = MIN(DIV_ROUND_UP(end, BDRV_SECTOR_SIZE) - sector_num,
+                             BDRV_REQUEST_MAX_SECTORS);
+        BlockDriverState *file;
+        int64_t status;
+        uint32_t len, flags;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL, sector_num,
+                                             nb_sectors, &pnum, &file);
+        if (status < 0) {
+            ret = status;
+            break;
+        }
+        if (pnum == 0) {
+            /* Past the end of the image */
+            ret = -EINVAL;
+            break;
+        }
+
+        len = MIN(((uint64_t)pnum << BDRV_SECTOR_BITS) - skip, end - offset);
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (nb_extents && extents[nb_extents - 1].flags == flags) {
+            extents[nb_extents - 1].length += len;
+        } else if (nb_extents < max_extents) {
+            extents[nb_extents].length = len;
+            extents[nb_extents].flags = flags;
+            nb_extents++;
+        } else {
+            break;
+        }
+        offset += len;
+    }
+
+    if (nb_extents == 0) {
+        g_free(extents);
+        return nbd_co_send_error_chunk(client, request->handle,
+                                       ret ? -ret : EINVAL);
+    }
+
+    TRACE("Sending %u extent(s)", nb_extents);
+    for (i = 0; i < nb_extents; i++) {
+        cpu_to_be32s(&extents[i].length);
+        cpu_to_be32s(&extents[i].flags);
+    }
+    stl_be_p(head, NBD_META_ID_BASE_ALLOCATION);
+    ret = nbd_co_send_chunk(client, request->handle, NBD_REPLY_FLAG_DONE,
+                            NBD_REPLY_TYPE_BLOCK_STATUS, head, sizeof(head),
+                            extents, nb_extents * sizeof(extents[0]));
+    g_free(extents);
+    return ret;
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -1147,13 +1557,16 @@ static ssize_t nbd_co_receive_request(NBDRequestData *req,
         rc = request->type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE)) {
+    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE |
+                           NBD_CMD_FLAG_REQ_ONE)) {
         LOG("unsupported flags (got 0x%x)", request->flags);
         rc = -EINVAL;
         goto out;
     }
-    if (request->type != NBD_CMD_WRITE_ZEROES &&
-        (request->flags & NBD_CMD_FLAG_NO_HOLE)) {
+    if ((request->type != NBD_CMD_WRITE_ZEROES &&
+         (request->flags & NBD_CMD_FLAG_NO_HOLE)) ||
+        (request->type != NBD_CMD_BLOCK_STATUS &&
+         (request->flags & NBD_CMD_FLAG_REQ_ONE))) {
         LOG("unexpected flags (got 0x%x)", request->flags);
         rc = -EINVAL;
         goto out;
@@ -1222,6 +1635,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1321,6 +1741,16 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation || request.len == 0) {
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+        if (nbd_co_send_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
@@ -1370,7 +1800,7 @@ static void nbd_set_handlers(NBDClient *client)
                            true,
                            client->can_read ? nbd_read : NULL,
                            client->send_coroutine ? nbd_restart_write : NULL,
-                           client);
+                           NULL, client);
     }
 }
 
@@ -1378,7 +1808,7 @@ static void nbd_unset_handlers(NBDClient *client)
 {
     if (client->exp && client->exp->ctx) {
         aio_set_fd_handler(client->exp->ctx, client->sioc->fd,
-                           true, NULL, NULL, NULL);
+                           true, NULL, NULL, NULL, NULL);
     }
 }
 
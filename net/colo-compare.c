@@ -40,6 +40,8 @@
 /* TODO: Should be configurable */
 #define REGULAR_PACKET_CHECK_MS 3000
 
+#define MAX_COMPARE_SHARDS 64
+
 /*
   + CompareState ++
   |               |
@@ -62,7 +64,45 @@
                     |packet  |  |packet  +    |packet  | |packet  +
                     +--------+  +--------+    +--------+ +--------+
 */
-typedef struct CompareState {
+typedef struct CompareState CompareState;
+
+typedef struct CompareStats {
+    /* primary packets that matched a secondary packet */
+    uint64_t matched;
+    /*
+     * comparisons that found no matching secondary packet; this also
+     * counts secondary packets that simply had not arrived yet
+     */
+    uint64_t unmatched;
+    /* packets dropped because their connection queue was full */
+    uint64_t dropped;
+} CompareStats;
+
+/*
+ * Connections are spread over shards by flow hash.  Each shard has its
+ * own connection table and a worker thread doing the comparison; the
+ * compare thread only reads the chardevs and hands packets over.
+ */
+typedef struct CompareShard {
+    CompareState *s;
+    QemuThread thread;
+
+    /* protects pri_in, sec_in, stop and stats */
+    QemuMutex lock;
+    QemuCond cond;
+    /* packets waiting for the worker, element type: Packet */
+    GQueue pri_in;
+    GQueue sec_in;
+    bool stop;
+    CompareStats stats;
+
+    /* the connections of this shard, see CompareState */
+    GQueue conn_list;
+    GHashTable *connection_track_table;
+    QemuMutex timer_check_lock;
+} CompareShard;
+
+struct CompareState {
     Object parent;
 
     char *pri_indev;
@@ -73,20 +113,21 @@ typedef struct CompareState {
     CharBackend chr_out;
     SocketReadState pri_rs;
     SocketReadState sec_rs;
+    /* serialises writes to chr_out from the compare and shard threads */
+    QemuMutex out_lock;
 
-    /* connection list: the connections belonged to this NIC could be found
-     * in this list.
+    /* Each shard has its own connection list and hashtable.
+     * connection list: the connections belonged to this shard could be
+     * found in this list.
      * element type: Connection
      */
-    GQueue conn_list;
-    /* hashtable to save connection */
-    GHashTable *connection_track_table;
+    CompareShard *shards;
+    uint32_t nshards;
     /* compare thread, a thread for each NIC */
     QemuThread thread;
     /* Timer used on the primary to find packets that are never matched */
     QEMUTimer *timer;
-    QemuMutex timer_check_lock;
-} CompareState;
+};
 
 typedef struct CompareClass {
     ObjectClass parent_class;
@@ -97,19 +138,22 @@ enum {
     SECONDARY_IN,
 };
 
-static int compare_chr_send(CharBackend *out,
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size);
 
 /*
+ * Called from the compare thread on the primary.  Pass the packet
+ * to the shard that owns its connection.
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
  */
-static int packet_enqueue(CompareState *s, int mode)
+static int packet_dispatch(CompareState *s, int mode)
 {
     ConnectionKey key;
     Packet *pkt = NULL;
-    Connection *conn;
+    CompareShard *shard;
+    bool idle;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf, s->pri_rs.packet_len);
@@ -124,34 +168,63 @@ static int packet_enqueue(CompareState *s, int mode)
     }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    shard = &s->shards[connection_key_hash(&key) % s->nshards];
+
+    qemu_mutex_lock(&shard->lock);
+    idle = g_queue_is_empty(&shard->pri_in) &&
+           g_queue_is_empty(&shard->sec_in);
+    if (mode == PRIMARY_IN) {
+        g_queue_push_tail(&shard->pri_in, pkt);
+    } else {
+        g_queue_push_tail(&shard->sec_in, pkt);
+    }
+    if (idle) {
+        qemu_cond_signal(&shard->cond);
+    }
+    qemu_mutex_unlock(&shard->lock);
+
+    return 0;
+}
+
+/*
+ * Called from the shard thread on the primary.
+ * Return the connection of the packet, or NULL if its queue was full
+ * and the packet was dropped.
+ */
+static Connection *packet_enqueue(CompareShard *shard, Packet *pkt, int mode)
+{
+    ConnectionKey key;
+    Connection *conn;
+    GQueue *queue;
+
+    fill_connection_key(pkt, &key);
+
+    qemu_mutex_lock(&shard->timer_check_lock);
+    conn = connection_get(shard->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &shard->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&shard->conn_list, conn);
         conn->processing = true;
     }
 
     if (mode == PRIMARY_IN) {
-        if (g_queue_get_length(&conn->primary_list) <=
-                               MAX_QUEUE_SIZE) {
-            g_queue_push_tail(&conn->primary_list, pkt);
-        } else {
-            error_report("colo compare primary queue size too big,"
-                         "drop packet");
-        }
+        queue = &conn->primary_list;
     } else {
-        if (g_queue_get_length(&conn->secondary_list) <=
-                               MAX_QUEUE_SIZE) {
-            g_queue_push_tail(&conn->secondary_list, pkt);
-        } else {
-            error_report("colo compare secondary queue size too big,"
-                         "drop packet");
-        }
+        queue = &conn->secondary_list;
     }
+    if (g_queue_get_length(queue) <= MAX_QUEUE_SIZE) {
+        g_queue_push_tail(queue, pkt);
+    } else {
+        error_report("colo compare %s queue size too big, drop packet",
+                     mode == PRIMARY_IN ? "primary" : "secondary");
+        packet_destroy(pkt, NULL);
+        conn = NULL;
+    }
+    qemu_mutex_unlock(&shard->timer_check_lock);
 
-    return 0;
+    return conn;
 }
 
 /*
@@ -334,30 +407,27 @@ static void colo_old_packet_check_one_conn(void *opaque,
  * if we have some then we have to checkpoint to wake
  * the secondary up.
  */
-static void colo_old_packet_check(void *opaque)
+static void colo_old_packet_check(CompareShard *shard)
 {
-    CompareState *s = opaque;
-
-    g_queue_foreach(&s->conn_list, colo_old_packet_check_one_conn, NULL);
+    g_queue_foreach(&shard->conn_list, colo_old_packet_check_one_conn, NULL);
 }
 
 /*
- * Called from the compare thread on the primary
+ * Called from the shard thread on the primary
  * for compare connection
  */
-static void colo_compare_connection(void *opaque, void *user_data)
+static void colo_compare_connection(CompareShard *shard, Connection *conn,
+                                    CompareStats *stats)
 {
-    CompareState *s = user_data;
-    Connection *conn = opaque;
-    Packet *pkt = NULL;
+    Packet *pkt = NULL, *spkt;
     GList *result = NULL;
     int ret;
 
     while (!g_queue_is_empty(&conn->primary_list) &&
            !g_queue_is_empty(&conn->secondary_list)) {
-        qemu_mutex_lock(&s->timer_check_lock);
+        qemu_mutex_lock(&shard->timer_check_lock);
         pkt = g_queue_pop_tail(&conn->primary_list);
-        qemu_mutex_unlock(&s->timer_check_lock);
+        qemu_mutex_unlock(&shard->timer_check_lock);
         switch (conn->ip_proto) {
         case IPPROTO_TCP:
             result = g_queue_find_custom(&conn->secondary_list,
@@ -378,13 +448,16 @@ static void colo_compare_connection(void *opaque, void *user_data)
         }
 
         if (result) {
-            ret = compare_chr_send(&s->chr_out, pkt->data, pkt->size);
+            ret = compare_chr_send(shard->s, pkt->data, pkt->size);
             if (ret < 0) {
                 error_report("colo_send_primary_packet failed");
             }
             trace_colo_compare_main("packet same and release packet");
-            g_queue_remove(&conn->secondary_list, result->data);
+            spkt = result->data;
+            g_queue_remove(&conn->secondary_list, spkt);
+            packet_destroy(spkt, NULL);
             packet_destroy(pkt, NULL);
+            stats->matched++;
         } else {
             /*
              * If one packet arrive late, the secondary_list or
@@ -392,16 +465,17 @@ static void colo_compare_connection(void *opaque, void *user_data)
              * until next comparison.
              */
             trace_colo_compare_main("packet different");
-            qemu_mutex_lock(&s->timer_check_lock);
+            qemu_mutex_lock(&shard->timer_check_lock);
             g_queue_push_tail(&conn->primary_list, pkt);
-            qemu_mutex_unlock(&s->timer_check_lock);
+            qemu_mutex_unlock(&shard->timer_check_lock);
+            stats->unmatched++;
             /* TODO: colo_notify_checkpoint();*/
             break;
         }
     }
 }
 
-static int compare_chr_send(CharBackend *out,
+static int compare_chr_send(CompareState *s,
                             const uint8_t *buf,
                             uint32_t size)
 {
@@ -412,19 +486,22 @@ static int compare_chr_send(CharBackend *out,
         return 0;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)&len, sizeof(len));
+    qemu_mutex_lock(&s->out_lock);
+    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
     if (ret != sizeof(len)) {
         goto err;
     }
 
-    ret = qemu_chr_fe_write_all(out, (uint8_t *)buf, size);
+    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)buf, size);
     if (ret != size) {
         goto err;
     }
+    qemu_mutex_unlock(&s->out_lock);
 
     return 0;
 
 err:
+    qemu_mutex_unlock(&s->out_lock);
     return ret < 0 ? ret : -EIO;
 }
 
@@ -489,6 +566,70 @@ static void *colo_compare_thread(void *opaque)
     return NULL;
 }
 
+/*
+ * Called from the shard thread on the primary.  Secondary packets are
+ * handled first so that the primary packets of the same batch can be
+ * matched against them right away; they also release primary packets
+ * that were waiting for a late secondary.
+ */
+static void colo_compare_shard_run(CompareShard *shard, GQueue *pri_in,
+                                   GQueue *sec_in, CompareStats *stats)
+{
+    Connection *conn;
+    Packet *pkt;
+
+    while ((pkt = g_queue_pop_head(sec_in))) {
+        conn = packet_enqueue(shard, pkt, SECONDARY_IN);
+        if (conn) {
+            colo_compare_connection(shard, conn, stats);
+        } else {
+            stats->dropped++;
+        }
+    }
+
+    while ((pkt = g_queue_pop_head(pri_in))) {
+        conn = packet_enqueue(shard, pkt, PRIMARY_IN);
+        if (conn) {
+            colo_compare_connection(shard, conn, stats);
+        } else {
+            stats->dropped++;
+        }
+    }
+}
+
+static void *colo_compare_shard_thread(void *opaque)
+{
+    CompareShard *shard = opaque;
+    CompareStats stats;
+    GQueue pri_in, sec_in;
+
+    qemu_mutex_lock(&shard->lock);
+    while (!shard->stop) {
+        if (g_queue_is_empty(&shard->pri_in) &&
+            g_queue_is_empty(&shard->sec_in)) {
+            qemu_cond_wait(&shard->cond, &shard->lock);
+            continue;
+        }
+
+        pri_in = shard->pri_in;
+        sec_in = shard->sec_in;
+        g_queue_init(&shard->pri_in);
+        g_queue_init(&shard->sec_in);
+        qemu_mutex_unlock(&shard->lock);
+
+        memset(&stats, 0, sizeof(stats));
+        colo_compare_shard_run(shard, &pri_in, &sec_in, &stats);
+
+        qemu_mutex_lock(&shard->lock);
+        shard->stats.matched += stats.matched;
+        shard->stats.unmatched += stats.unmatched;
+        shard->stats.dropped += stats.dropped;
+    }
+    qemu_mutex_unlock(&shard->lock);
+
+    return NULL;
+}
+
 static char *compare_get_pri_indev(Object *obj, Error **errp)
 {
     CompareState *s = COLO_COMPARE(obj);
@@ -534,16 +675,69 @@ static void compare_set_outdev(Object *obj, const char *value, Error **errp)
     s->outdev = g_strdup(value);
 }
 
+static void compare_get_shards(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->nshards;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_shards(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    if (s->shards) {
+        error_setg(&local_err, "Property '%s.%s' can't be changed after "
+                   "creation", object_get_typename(obj), name);
+        goto out;
+    }
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value == 0 || value > MAX_COMPARE_SHARDS) {
+        error_setg(&local_err, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, MAX_COMPARE_SHARDS);
+        goto out;
+    }
+    s->nshards = value;
+
+out:
+    error_propagate(errp, local_err);
+}
+
+/* Sum a CompareStats field, given as offset in @opaque, over all shards */
+static void compare_get_stat(Object *obj, Visitor *v, const char *name,
+                             void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    size_t offset = (uintptr_t)opaque;
+    uint64_t value = 0;
+    int i;
+
+    for (i = 0; s->shards && i < s->nshards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->lock);
+        value += *(uint64_t *)((char *)&shard->stats + offset);
+        qemu_mutex_unlock(&shard->lock);
+    }
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
 
-    if (packet_enqueue(s, PRIMARY_IN)) {
+    if (packet_dispatch(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
-        compare_chr_send(&s->chr_out, pri_rs->buf, pri_rs->packet_len);
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
+        compare_chr_send(s, pri_rs->buf, pri_rs->packet_len);
     }
 }
 
@@ -551,11 +745,8 @@ static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
 
-    if (packet_enqueue(s, SECONDARY_IN)) {
+    if (packet_dispatch(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
     }
 }
 
@@ -591,6 +782,7 @@ static int find_and_check_chardev(CharDriverState **chr,
 static void check_old_packet_regular(void *opaque)
 {
     CompareState *s = opaque;
+    int i;
 
     timer_mod(s->timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
               REGULAR_PACKET_CHECK_MS);
@@ -599,9 +791,19 @@ static void check_old_packet_regular(void *opaque)
      * TODO: Make timer handler run in compare thread
      * like qemu_chr_add_handlers_full.
      */
-    qemu_mutex_lock(&s->timer_check_lock);
-    colo_old_packet_check(s);
-    qemu_mutex_unlock(&s->timer_check_lock);
+    for (i = 0; i < s->nshards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->timer_check_lock);
+        colo_old_packet_check(shard);
+        qemu_mutex_unlock(&shard->timer_check_lock);
+
+        qemu_mutex_lock(&shard->lock);
+        trace_colo_compare_shard_stats(i, shard->stats.matched,
+                                       shard->stats.unmatched,
+                                       shard->stats.dropped);
+        qemu_mutex_unlock(&shard->lock);
+    }
 }
 
 /*
@@ -614,6 +816,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
     CharDriverState *chr;
     char thread_name[64];
     static int compare_id;
+    int i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -645,13 +848,32 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
     net_socket_rs_init(&s->pri_rs, compare_pri_rs_finalize);
     net_socket_rs_init(&s->sec_rs, compare_sec_rs_finalize);
 
-    g_queue_init(&s->conn_list);
-    qemu_mutex_init(&s->timer_check_lock);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+    qemu_mutex_init(&s->out_lock);
+
+    s->shards = g_new0(CompareShard, s->nshards);
+    for (i = 0; i < s->nshards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        shard->s = s;
+        qemu_mutex_init(&shard->lock);
+        qemu_cond_init(&shard->cond);
+        g_queue_init(&shard->pri_in);
+        g_queue_init(&shard->sec_in);
+        g_queue_init(&shard->conn_list);
+        qemu_mutex_init(&shard->timer_check_lock);
+
+        shard->connection_track_table =
+            g_hash_table_new_full(connection_key_hash,
+                                  connection_key_equal,
+                                  g_free,
+                                  connection_destroy);
+
+        snprintf(thread_name, sizeof(thread_name), "colo-compare %d/%d",
+                 compare_id, i);
+        qemu_thread_create(&shard->thread, thread_name,
+                           colo_compare_shard_thread, shard,
+                           QEMU_THREAD_JOINABLE);
+    }
 
     sprintf(thread_name, "colo-compare %d", compare_id);
     qemu_thread_create(&s->thread, thread_name,
@@ -677,6 +899,10 @@ static void colo_compare_class_init(ObjectClass *oc, void *data)
 
 static void colo_compare_init(Object *obj)
 {
+    CompareState *s = COLO_COMPARE(obj);
+
+    s->nshards = 1;
+
     object_property_add_str(obj, "primary_in",
                             compare_get_pri_indev, compare_set_pri_indev,
                             NULL);
@@ -686,29 +912,55 @@ static void colo_compare_init(Object *obj)
     object_property_add_str(obj, "outdev",
                             compare_get_outdev, compare_set_outdev,
                             NULL);
+    object_property_add(obj, "shards", "int",
+                        compare_get_shards, compare_set_shards,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "matched", "int", compare_get_stat, NULL, NULL,
+                        (void *)offsetof(CompareStats, matched), NULL);
+    object_property_add(obj, "unmatched", "int", compare_get_stat, NULL, NULL,
+                        (void *)offsetof(CompareStats, unmatched), NULL);
+    object_property_add(obj, "dropped", "int", compare_get_stat, NULL, NULL,
+                        (void *)offsetof(CompareStats, dropped), NULL);
 }
 
 static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
+    int i;
 
     qemu_chr_fe_deinit(&s->chr_pri_in);
     qemu_chr_fe_deinit(&s->chr_sec_in);
     qemu_chr_fe_deinit(&s->chr_out);
 
-    g_queue_free(&s->conn_list);
-
-    if (qemu_thread_is_self(&s->thread)) {
-        /* compare connection */
-        g_queue_foreach(&s->conn_list, colo_compare_connection, s);
-        qemu_thread_join(&s->thread);
-    }
-
     if (s->timer) {
         timer_del(s->timer);
     }
 
-    qemu_mutex_destroy(&s->timer_check_lock);
+    for (i = 0; s->shards && i < s->nshards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->lock);
+        shard->stop = true;
+        qemu_cond_signal(&shard->cond);
+        qemu_mutex_unlock(&shard->lock);
+        qemu_thread_join(&shard->thread);
+
+        g_queue_foreach(&shard->pri_in, packet_destroy, NULL);
+        g_queue_clear(&shard->pri_in);
+        g_queue_foreach(&shard->sec_in, packet_destroy, NULL);
+        g_queue_clear(&shard->sec_in);
+        /* the connections themselves are owned by the hashtable */
+        g_queue_clear(&shard->conn_list);
+        g_hash_table_destroy(shard->connection_track_table);
+
+        qemu_mutex_destroy(&shard->timer_check_lock);
+        qemu_cond_destroy(&shard->cond);
+        qemu_mutex_destroy(&shard->lock);
+    }
+    if (s->shards) {
+        qemu_mutex_destroy(&s->out_lock);
+        g_free(s->shards);
+    }
 
     g_free(s->pri_indev);
     g_free(s->sec_indev);
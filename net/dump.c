@@ -30,13 +30,43 @@
 #include "qemu/iov.h"
 #include "qemu/log.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 #include "qapi/visitor.h"
 #include "net/filter.h"
 
+/* How often the writer thread flushes a ring that is not filling up */
+#define DUMP_FLUSH_INTERVAL_MS 100
+
 typedef struct DumpState {
     int64_t start_ts;
     int fd;
     int pcap_caplen;
+
+    /* Asynchronous mode: packets are copied into @ring by the net layer
+     * and written out by a separate thread.  @head is only advanced by the
+     * producer and @tail only by the writer; both count bytes and are
+     * reduced modulo @ring_size, a power of two, when indexing.  They are
+     * size_t so that they can be accessed atomically on any host; since
+     * only differences are used, wrapping around is harmless.
+     */
+    uint8_t *ring;
+    size_t ring_size;
+    size_t head;
+    size_t tail;
+    bool kicked;
+    bool stopping;
+    bool failed;
+    uint64_t dropped;
+    QemuSemaphore sem;
+    QemuThread thread;
+
+    /* Rotation, done by the writer thread */
+    char *filename;
+    uint64_t rotate_size;
+    uint32_t rotate_count;
+    uint64_t file_size;
 } DumpState;
 
 #define PCAP_MAGIC 0xa1b2c3d4
@@ -60,6 +90,64 @@ struct pcap_sf_pkthdr {
     uint32_t len;
 };
 
+static void dump_ring_put(DumpState *s, size_t pos, const void *buf,
+                          size_t len)
+{
+    size_t off = pos & (s->ring_size - 1);
+    size_t first = MIN(len, s->ring_size - off);
+
+    memcpy(s->ring + off, buf, first);
+    memcpy(s->ring, buf + first, len - first);
+}
+
+static void dump_ring_get(DumpState *s, size_t pos, void *buf, size_t len)
+{
+    size_t off = pos & (s->ring_size - 1);
+    size_t first = MIN(len, s->ring_size - off);
+
+    memcpy(buf, s->ring + off, first);
+    memcpy(buf + first, s->ring, len - first);
+}
+
+/* Runs with the iothread lock held, so there is a single producer */
+static void dump_receive_async(DumpState *s, struct pcap_sf_pkthdr *hdr,
+                               const struct iovec *iov, int cnt)
+{
+    size_t head = s->head;
+    size_t pos;
+    size_t need = sizeof(*hdr) + hdr->caplen;
+    size_t left = hdr->caplen;
+    int i;
+
+    if (atomic_read(&s->failed)) {
+        return;
+    }
+
+    if (head + need - atomic_mb_read(&s->tail) > s->ring_size) {
+        s->dropped++;
+        return;
+    }
+
+    dump_ring_put(s, head, hdr, sizeof(*hdr));
+    pos = head + sizeof(*hdr);
+    for (i = 0; i < cnt && left; i++) {
+        size_t len = MIN(left, iov[i].iov_len);
+
+        dump_ring_put(s, pos, iov[i].iov_base, len);
+        pos += len;
+        left -= len;
+    }
+
+    /* Publish the record only once it is complete */
+    smp_wmb();
+    atomic_set(&s->head, head + need);
+
+    if (head + need - atomic_read(&s->tail) >= s->ring_size / 4 &&
+        !atomic_xchg(&s->kicked, true)) {
+        qemu_sem_post(&s->sem);
+    }
+}
+
 static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
 {
     struct pcap_sf_pkthdr hdr;
@@ -68,8 +156,10 @@ static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
     size_t size = iov_size(iov, cnt);
     struct iovec dumpiov[cnt + 1];
 
-    /* Early return in case of previous error. */
-    if (s->fd < 0) {
+    /* Early return in case of previous error.  In asynchronous mode the fd
+     * belongs to the writer thread, which reports errors through @failed.
+     */
+    if (!s->ring && s->fd < 0) {
         return size;
     }
 
@@ -81,6 +171,11 @@ static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
     hdr.caplen = caplen;
     hdr.len = size;
 
+    if (s->ring) {
+        dump_receive_async(s, &hdr, iov, cnt);
+        return size;
+    }
+
     dumpiov[0].iov_base = &hdr;
     dumpiov[0].iov_len = sizeof(hdr);
     cnt = iov_copy(&dumpiov[1], cnt, iov, cnt, 0, caplen);
@@ -94,17 +189,9 @@ static ssize_t dump_receive_iov(DumpState *s, const struct iovec *iov, int cnt)
     return size;
 }
 
-static void dump_cleanup(DumpState *s)
-{
-    close(s->fd);
-    s->fd = -1;
-}
-
-static int net_dump_state_init(DumpState *s, const char *filename,
-                               int len, Error **errp)
+static int dump_open_file(const char *filename, int len, Error **errp)
 {
     struct pcap_file_hdr hdr;
-    struct tm tm;
     int fd;
 
     fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
@@ -127,6 +214,157 @@ static int net_dump_state_init(DumpState *s, const char *filename,
         return -1;
     }
 
+    return fd;
+}
+
+/* Shift FILE.1 ... FILE.n-1 up by one, move FILE to FILE.1 and start a
+ * new FILE.  The oldest file is overwritten by the renames.
+ */
+static int dump_rotate(DumpState *s)
+{
+    Error *local_err = NULL;
+    uint32_t i;
+
+    close(s->fd);
+    for (i = s->rotate_count; i > 0; i--) {
+        char *from = i > 1 ? g_strdup_printf("%s.%u", s->filename, i - 1)
+                           : g_strdup(s->filename);
+        char *to = g_strdup_printf("%s.%u", s->filename, i);
+
+        if (rename(from, to) < 0 && errno != ENOENT) {
+            error_report("network dump: can't rename %s to %s: %s",
+                         from, to, strerror(errno));
+        }
+        g_free(from);
+        g_free(to);
+    }
+
+    s->fd = dump_open_file(s->filename, s->pcap_caplen, &local_err);
+    if (s->fd < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    s->file_size = sizeof(struct pcap_file_hdr);
+    return 0;
+}
+
+/* Write out everything the producer has published so far */
+static void dump_writer_flush(DumpState *s)
+{
+    size_t head = atomic_mb_read(&s->head);
+    size_t tail = s->tail;
+
+    while (tail != head) {
+        size_t end = head;
+        size_t off, len, first;
+
+        if (s->rotate_size) {
+            /* Stop at the record that would make the file too big */
+            for (end = tail; end != head; ) {
+                struct pcap_sf_pkthdr hdr;
+                uint64_t rec;
+
+                dump_ring_get(s, end, &hdr, sizeof(hdr));
+                rec = sizeof(hdr) + hdr.caplen;
+                if (s->file_size + (end - tail) + rec > s->rotate_size &&
+                    s->file_size + (end - tail) >
+                    sizeof(struct pcap_file_hdr)) {
+                    break;
+                }
+                end += rec;
+            }
+            if (end == tail) {
+                if (dump_rotate(s) < 0) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        off = tail & (s->ring_size - 1);
+        len = end - tail;
+        first = MIN(len, s->ring_size - off);
+        if (qemu_write_full(s->fd, s->ring + off, first) != first ||
+            qemu_write_full(s->fd, s->ring, len - first) != len - first) {
+            error_report("network dump write error - stopping dump");
+            break;
+        }
+        s->file_size += len;
+        tail = end;
+        atomic_mb_set(&s->tail, tail);
+    }
+
+    if (tail != head) {
+        atomic_set(&s->failed, true);
+    }
+}
+
+static void *dump_writer_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    while (!atomic_read(&s->failed)) {
+        bool stopping;
+
+        qemu_sem_timedwait(&s->sem, DUMP_FLUSH_INTERVAL_MS);
+        atomic_set(&s->kicked, false);
+        stopping = atomic_mb_read(&s->stopping);
+        dump_writer_flush(s);
+        if (stopping) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Switch @s to asynchronous mode with a ring of at least @bufsize bytes */
+static void dump_async_start(DumpState *s, const char *filename,
+                             uint64_t bufsize, uint64_t rotate_size,
+                             uint32_t rotate_count)
+{
+    s->ring_size = pow2ceil(MAX(bufsize, sizeof(struct pcap_sf_pkthdr) +
+                                         s->pcap_caplen));
+    s->ring = g_malloc(s->ring_size);
+    s->filename = g_strdup(filename);
+    s->rotate_size = rotate_size;
+    s->rotate_count = rotate_count;
+    s->file_size = sizeof(struct pcap_file_hdr);
+    qemu_sem_init(&s->sem, 0);
+    qemu_thread_create(&s->thread, "filter-dump", dump_writer_thread, s,
+                       QEMU_THREAD_JOINABLE);
+}
+
+static void dump_cleanup(DumpState *s)
+{
+    if (s->ring) {
+        atomic_mb_set(&s->stopping, true);
+        qemu_sem_post(&s->sem);
+        qemu_thread_join(&s->thread);
+        qemu_sem_destroy(&s->sem);
+        if (s->dropped) {
+            error_report("network dump: %" PRIu64 " packets dropped",
+                         s->dropped);
+        }
+        g_free(s->ring);
+        s->ring = NULL;
+        g_free(s->filename);
+        s->filename = NULL;
+    }
+    close(s->fd);
+    s->fd = -1;
+}
+
+static int net_dump_state_init(DumpState *s, const char *filename,
+                               int len, Error **errp)
+{
+    struct tm tm;
+    int fd;
+
+    fd = dump_open_file(filename, len, errp);
+    if (fd < 0) {
+        return -1;
+    }
+
     s->fd = fd;
     s->pcap_caplen = len;
 
@@ -241,6 +479,10 @@ struct NetFilterDumpState {
     DumpState ds;
     char *filename;
     uint32_t maxlen;
+    /* ring size for asynchronous writes, 0 to write synchronously */
+    uint64_t bufsize;
+    uint64_t rotate_size;
+    uint32_t rotate_count;
 };
 typedef struct NetFilterDumpState NetFilterDumpState;
 
@@ -269,8 +511,78 @@ static void filter_dump_setup(NetFilterState *nf, Error **errp)
         error_setg(errp, "dump filter needs 'file' property set!");
         return;
     }
+    if (nfds->rotate_size && !nfds->bufsize) {
+        error_setg(errp, "dump filter can only rotate files with bufsize > 0");
+        return;
+    }
+
+    if (net_dump_state_init(&nfds->ds, nfds->filename, nfds->maxlen,
+                            errp) < 0) {
+        return;
+    }
+    if (nfds->bufsize) {
+        dump_async_start(&nfds->ds, nfds->filename, nfds->bufsize,
+                         nfds->rotate_size, nfds->rotate_count);
+    }
+}
+
+static void filter_dump_get_size(Object *obj, Visitor *v, const char *name,
+                                 void *opaque, Error **errp)
+{
+    uint64_t *field = opaque;
+    uint64_t value = *field;
+
+    visit_type_size(v, name, &value, errp);
+}
+
+static void filter_dump_set_size(Object *obj, Visitor *v, const char *name,
+                                 void *opaque, Error **errp)
+{
+    uint64_t *field = opaque;
+    Error *local_err = NULL;
+    uint64_t value;
+
+    visit_type_size(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    *field = value;
+}
+
+static void filter_dump_get_rotate_count(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    uint32_t value = nfds->rotate_count;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void filter_dump_set_rotate_count(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    nfds->rotate_count = value;
+}
+
+static void filter_dump_get_dropped(Object *obj, Visitor *v, const char *name,
+                                    void *opaque, Error **errp)
+{
+    NetFilterDumpState *nfds = FILTER_DUMP(obj);
+    uint64_t value = nfds->ds.dropped;
 
-    net_dump_state_init(&nfds->ds, nfds->filename, nfds->maxlen, errp);
+    visit_type_uint64(v, name, &value, errp);
 }
 
 static void filter_dump_get_maxlen(Object *obj, Visitor *v, const char *name,
@@ -324,9 +636,20 @@ static void filter_dump_instance_init(Object *obj)
     NetFilterDumpState *nfds = FILTER_DUMP(obj);
 
     nfds->maxlen = 65536;
+    nfds->bufsize = 4 * 1024 * 1024;
+    nfds->rotate_count = 1;
 
     object_property_add(obj, "maxlen", "int", filter_dump_get_maxlen,
                         filter_dump_set_maxlen, NULL, NULL, NULL);
+    object_property_add(obj, "bufsize", "size", filter_dump_get_size,
+                        filter_dump_set_size, NULL, &nfds->bufsize, NULL);
+    object_property_add(obj, "rotate-size", "size", filter_dump_get_size,
+                        filter_dump_set_size, NULL, &nfds->rotate_size, NULL);
+    object_property_add(obj, "rotate-count", "int",
+                        filter_dump_get_rotate_count,
+                        filter_dump_set_rotate_count, NULL, NULL, NULL);
+    object_property_add(obj, "dropped", "int", filter_dump_get_dropped,
+                        NULL, NULL, NULL, NULL);
     object_property_add_str(obj, "file", file_dump_get_filename,
                             file_dump_set_filename, NULL);
 }
@@ -678,6 +678,43 @@ ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size)
                                              buf, size, NULL);
 }
 
+/* Send several linear packets at once.  If the peer can take them in bulk
+ * they skip the per-packet queue traversal, otherwise (or for whatever it
+ * could not take) they are sent one by one.
+ *
+ * Returns 0 if some packets were queued, in which case @sent_cb will be
+ * called for each of them, or @npkts otherwise.
+ */
+ssize_t qemu_send_packets_async(NetClientState *sender,
+                                const struct iovec *pkts, int npkts,
+                                NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    ssize_t ret = npkts;
+    int i = 0;
+
+    if (sender->link_down || !peer) {
+        return npkts;
+    }
+
+    /* Filters work on single packets */
+    if (peer->info->receive_batch &&
+        QTAILQ_EMPTY(&sender->filters) && QTAILQ_EMPTY(&peer->filters)) {
+        i = qemu_net_queue_send_batch(peer->incoming_queue, sender,
+                                      pkts, npkts,
+                                      qemu_deliver_packet_batch);
+    }
+
+    for (; i < npkts; i++) {
+        if (qemu_send_packet_async(sender, pkts[i].iov_base, pkts[i].iov_len,
+                                   sent_cb) == 0) {
+            ret = 0;
+        }
+    }
+
+    return ret;
+}
+
 static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
                                int iovcnt, unsigned flags)
 {
@@ -739,6 +776,30 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              const struct iovec *pkts,
+                              int npkts,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return npkts;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    ret = nc->info->receive_batch(nc, pkts, npkts);
+    if (ret < npkts) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
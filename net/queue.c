@@ -232,6 +232,33 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Deliver a batch of linear packets without queueing any of them.  This
+ * only happens when nothing is queued or being delivered, so that packets
+ * stay in order; the caller sends whatever was not delivered through
+ * qemu_net_queue_send().
+ *
+ * Returns the number of packets delivered.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              const struct iovec *pkts,
+                              int npkts,
+                              NetQueueDeliverBatchFunc *deliver_batch)
+{
+    int ret;
+
+    if (queue->delivering || !QTAILQ_EMPTY(&queue->packets) ||
+        !qemu_can_send_packet(sender)) {
+        return 0;
+    }
+
+    queue->delivering = 1;
+    ret = deliver_batch(sender, pkts, npkts, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -34,6 +34,9 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+/* Datagrams drained per recvmmsg() call */
+#define NET_SOCKET_BATCH 8
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -44,6 +47,9 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_LINUX
+    uint8_t *dgram_bufs;          /* NET_SOCKET_BATCH x NET_BUFSIZE */
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
@@ -189,6 +195,47 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_LINUX
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    struct iovec pkts[NET_SOCKET_BATCH];
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        pkts[i].iov_base = s->dgram_bufs + i * NET_BUFSIZE;
+        pkts[i].iov_len = NET_BUFSIZE;
+        msgs[i].msg_hdr.msg_iov = &pkts[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(s->fd, msgs, NET_SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        pkts[i].iov_len = msgs[i].msg_len;
+        if (msgs[i].msg_len == 0) {
+            break;
+        }
+    }
+
+    if (i && qemu_send_packets_async(&s->nc, pkts, i,
+                                     net_socket_send_completed) == 0) {
+        net_socket_read_poll(s, false);
+    }
+    if (i < n || n == 0) {
+        /* end of connection */
+        net_socket_read_poll(s, false);
+        net_socket_write_poll(s, false);
+    }
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -208,6 +255,7 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_read_poll(s, false);
     }
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -308,6 +356,10 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_LINUX
+    g_free(s->dgram_bufs);
+    s->dgram_bufs = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
@@ -366,6 +418,9 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+#ifdef CONFIG_LINUX
+    s->dgram_bufs = g_malloc(NET_SOCKET_BATCH * NET_BUFSIZE);
+#endif
     net_socket_rs_init(&s->rs, net_socket_rs_finalize);
     net_socket_read_poll(s, true);
 
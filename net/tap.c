@@ -45,12 +45,19 @@
 
 #include "net/vhost_net.h"
 
+/* Frames read from the tap fd before handing them to the peer at once.
+ * There is no multi-frame read on a tap fd, so this saves the per-frame
+ * work in the net layer and the guest notifications, not the syscalls.
+ */
+#define TAP_BATCH_SIZE 8
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    /* TAP_BATCH_SIZE buffers of NET_BUFSIZE bytes */
+    uint8_t *bufs;
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -182,40 +189,49 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    struct iovec pkts[TAP_BATCH_SIZE];
     int packets = 0;
+    bool drained = false;
 
-    while (true) {
-        uint8_t *buf = s->buf;
+    /*
+     * When the host keeps receiving more packets while tap_send() is
+     * running we can hog the QEMU global mutex.  Limit the number of
+     * packets that are processed per tap_send() callback to prevent
+     * stalling the guest.
+     */
+    while (!drained && packets < 50) {
+        int n = 0;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+        while (n < TAP_BATCH_SIZE && packets + n < 50) {
+            uint8_t *buf = s->bufs + n * NET_BUFSIZE;
+            int size;
+
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                drained = true;
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            pkts[n].iov_base = buf;
+            pkts[n].iov_len = size;
+            n++;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
+        if (!n) {
             break;
         }
 
-        /*
-         * When the host keeps receiving more packets while tap_send() is
-         * running we can hog the QEMU global mutex.  Limit the number of
-         * packets that are processed per tap_send() callback to prevent
-         * stalling the guest.
-         */
-        packets++;
-        if (packets >= 50) {
+        if (qemu_send_packets_async(&s->nc, pkts, n,
+                                    tap_send_completed) == 0) {
+            tap_read_poll(s, false);
             break;
         }
+        packets += n;
     }
 }
 
@@ -325,6 +341,9 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+
+    g_free(s->bufs);
+    s->bufs = NULL;
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -375,6 +394,7 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     s = DO_UPCAST(TAPState, nc, nc);
 
     s->fd = fd;
+    s->bufs = g_malloc(TAP_BATCH_SIZE * NET_BUFSIZE);
     s->host_vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
     s->using_vnet_hdr = false;
     s->has_ufo = tap_probe_has_ufo(s->fd);
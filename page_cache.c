@@ -29,26 +29,42 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * The cache is set associative: a page can live in any of the
+ * CACHE_WAYS slots of the set selected by its address, and a miss
+ * replaces the least recently used slot of the set.  Sets are grouped
+ * in chunks that are only allocated when a page is first inserted into
+ * them, so a large, mostly unused cache costs little memory.
+ */
+#define CACHE_WAYS        8
+#define CACHE_CHUNK_BITS  8
+#define CACHE_CHUNK_SETS  (1 << CACHE_CHUNK_BITS)
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* value of PageCache.clock at the last hit or insertion */
+    uint64_t it_used;
     uint8_t *it_data;
 };
 
 struct PageCache {
-    CacheItem *page_cache;
+    /* nr_sets / CACHE_CHUNK_SETS (at least 1) chunks of sets */
+    CacheItem **chunks;
+    int64_t nr_chunks;
+    int64_t nr_sets;
+    unsigned int ways;
     unsigned int page_size;
+    unsigned int page_bits;
     int64_t max_num_items;
-    uint64_t max_item_age;
     int64_t num_items;
+    uint64_t clock;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 {
-    int64_t i;
-
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -57,7 +73,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -68,80 +84,150 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
     cache->page_size = page_size;
-    cache->num_items = 0;
-    cache->max_item_age = 0;
+    cache->page_bits = ctz32(page_size);
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->nr_sets = num_pages / cache->ways;
+    cache->nr_chunks = DIV_ROUND_UP(cache->nr_sets, CACHE_CHUNK_SETS);
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->nr_sets, cache->ways);
 
     /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
-        DPRINTF("Failed to allocate cache->page_cache\n");
+    cache->chunks = g_try_new0(CacheItem *, cache->nr_chunks);
+    if (!cache->chunks) {
+        DPRINTF("Failed to allocate cache->chunks\n");
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
-
     return cache;
 }
 
+static int64_t cache_chunk_items(const PageCache *cache)
+{
+    return MIN(cache->nr_sets, CACHE_CHUNK_SETS) * cache->ways;
+}
+
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
+    int64_t i, j;
 
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->chunks);
+
+    for (i = 0; i < cache->nr_chunks; i++) {
+        CacheItem *chunk = cache->chunks[i];
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
+        if (!chunk) {
+            continue;
+        }
+        for (j = 0; j < cache_chunk_items(cache); j++) {
+            g_free(chunk[j].it_data);
+        }
+        g_free(chunk);
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
+    g_free(cache->chunks);
+    cache->chunks = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static int64_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    uint64_t pfn = address >> cache->page_bits;
+
+    g_assert(cache->nr_sets);
+    /* fold in the higher bits so that strided accesses spread out */
+    return (pfn ^ (pfn >> ctz64(cache->nr_sets)) ^ (pfn >> 32)) &
+           (cache->nr_sets - 1);
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns the first slot of the set for @addr, or NULL if its chunk
+ * has not been allocated yet.
+ */
+static CacheItem *cache_get_set_items(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    int64_t set;
+    CacheItem *chunk;
 
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->chunks);
+
+    set = cache_get_set(cache, addr);
+    chunk = cache->chunks[set >> CACHE_CHUNK_BITS];
+    if (!chunk) {
+        return NULL;
+    }
+    return chunk + (set & (CACHE_CHUNK_SETS - 1)) * cache->ways;
+}
+
+/* Like cache_get_set_items, but allocates the chunk if needed */
+static CacheItem *cache_alloc_set_items(PageCache *cache, uint64_t addr)
+{
+    int64_t chunk = cache_get_set(cache, addr) >> CACHE_CHUNK_BITS;
+
+    if (!cache->chunks[chunk]) {
+        cache->chunks[chunk] = g_try_new0(CacheItem, cache_chunk_items(cache));
+        if (!cache->chunks[chunk]) {
+            DPRINTF("Error allocating chunk\n");
+            return NULL;
+        }
+    }
+    return cache_get_set_items(cache, addr);
+}
+
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *items;
+    unsigned int i;
 
-    pos = cache_get_cache_pos(cache, addr);
+    items = cache_get_set_items(cache, addr);
+    if (!items) {
+        return NULL;
+    }
+    for (i = 0; i < cache->ways; i++) {
+        if (items[i].it_data && items[i].it_addr == addr) {
+            return &items[i];
+        }
+    }
+    return NULL;
+}
 
-    return &cache->page_cache[pos];
+/* Returns an empty slot of the set if there is one, else the LRU slot */
+static CacheItem *cache_get_victim(const PageCache *cache, CacheItem *items)
+{
+    CacheItem *victim = &items[0];
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (!items[i].it_data) {
+            return &items[i];
+        }
+        if (items[i].it_used < victim->it_used) {
+            victim = &items[i];
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_used = ++cache->clock;
         return true;
     }
     return false;
@@ -150,17 +236,26 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
+    CacheItem *items, *it;
+    int ret = 0;
 
-    CacheItem *it;
-
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        items = cache_alloc_set_items(cache, addr);
+        if (!items) {
+            return -1;
+        }
+        it = cache_get_victim(cache, items);
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+        if (it->it_data) {
+            if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+                /* even the LRU page is fresh, don't replace it */
+                return -1;
+            }
+            ret = 1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -175,21 +270,22 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     it->it_age = current_age;
     it->it_addr = addr;
+    it->it_used = ++cache->clock;
 
-    return 0;
+    return ret;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
-    int64_t i;
+    int64_t i, j;
 
     CacheItem *old_it, *new_it;
 
     g_assert(cache);
 
     /* cache was not inited */
-    if (cache->page_cache == NULL) {
+    if (cache->chunks == NULL) {
         return -1;
     }
 
@@ -203,32 +299,42 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         DPRINTF("Error creating new cache\n");
         return -1;
     }
+    new_cache->clock = cache->clock;
 
     /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
+    for (i = 0; i < cache->nr_chunks; i++) {
+        CacheItem *chunk = cache->chunks[i];
+
+        if (!chunk) {
+            continue;
+        }
+        for (j = 0; j < cache_chunk_items(cache); j++) {
+            CacheItem *items;
+
+            old_it = &chunk[j];
+            if (!old_it->it_data) {
+                continue;
+            }
+
+            items = cache_alloc_set_items(new_cache, old_it->it_addr);
+            new_it = items ? cache_get_victim(new_cache, items) : NULL;
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
+            if (!new_it ||
+                (new_it->it_data && new_it->it_used >= old_it->it_used)) {
                 g_free(old_it->it_data);
             } else {
                 if (!new_it->it_data) {
                     new_cache->num_items++;
                 }
                 g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+                *new_it = *old_it;
             }
         }
+        g_free(chunk);
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
+    g_free(cache->chunks);
+    *cache = *new_cache;
 
     g_free(new_cache);
 
@@ -49,6 +49,7 @@
 #define QEMU_NBD_OPT_TLSCREDS      261
 #define QEMU_NBD_OPT_IMAGE_OPTS    262
 #define QEMU_NBD_OPT_FORK          263
+#define QEMU_NBD_OPT_MULTI_CONN    264
 
 #define MBR_SIZE 512
 
@@ -80,6 +81,8 @@ static void usage(const char *name)
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"      --multi-conn          with -e, let a client spread its requests over\n"
+"                            several connections\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name\n"
@@ -272,7 +275,7 @@ static void *nbd_client_thread(void *arg)
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
                                 NULL, NULL, NULL,
-                                &size, &local_error);
+                                &size, NULL, &local_error);
     if (ret < 0) {
         if (local_error) {
             error_report_err(local_error);
@@ -499,6 +502,7 @@ int main(int argc, char **argv)
         { "detect-zeroes", required_argument, NULL,
           QEMU_NBD_OPT_DETECT_ZEROES },
         { "shared", required_argument, NULL, 'e' },
+        { "multi-conn", no_argument, NULL, QEMU_NBD_OPT_MULTI_CONN },
         { "format", required_argument, NULL, 'f' },
         { "persistent", no_argument, NULL, 't' },
         { "verbose", no_argument, NULL, 'v' },
@@ -730,9 +734,19 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_FORK:
             fork_process = true;
             break;
+        case QEMU_NBD_OPT_MULTI_CONN:
+            /* All connections go through the same BlockBackend, so a
+             * flush on any of them covers writes completed on the others */
+            nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+            break;
         }
     }
 
+    if ((nbdflags & NBD_FLAG_CAN_MULTI_CONN) && shared < 2) {
+        error_report("--multi-conn requires --shared greater than 1");
+        exit(EXIT_FAILURE);
+    }
+
     if ((argc - optind) != 1) {
         error_report("Invalid number of arguments");
         error_printf("Try `%s --help' for more information.\n", argv[0]);
@@ -18,6 +18,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/main-loop.h"
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "exec/exec-all.h"
@@ -132,7 +133,13 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
-            val = cpu_get_apic_tpr(x86_env_get_cpu(env)->apic_state);
+            if (!qemu_mutex_iothread_locked()) {
+                qemu_mutex_lock_iothread();
+                val = cpu_get_apic_tpr(x86_env_get_cpu(env)->apic_state);
+                qemu_mutex_unlock_iothread();
+            } else {
+                val = cpu_get_apic_tpr(x86_env_get_cpu(env)->apic_state);
+            }
         } else {
             val = env->v_tpr;
         }
@@ -156,7 +163,13 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
-            cpu_set_apic_tpr(x86_env_get_cpu(env)->apic_state, t0);
+            if (!qemu_mutex_iothread_locked()) {
+                qemu_mutex_lock_iothread();
+                cpu_set_apic_tpr(x86_env_get_cpu(env)->apic_state, t0);
+                qemu_mutex_unlock_iothread();
+            } else {
+                cpu_set_apic_tpr(x86_env_get_cpu(env)->apic_state, t0);
+            }
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -244,7 +257,13 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+        if (!qemu_mutex_iothread_locked()) {
+            qemu_mutex_lock_iothread();
+            cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+            qemu_mutex_unlock_iothread();
+        } else {
+            cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+        }
         break;
     case MSR_EFER:
         {
@@ -401,7 +420,13 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+        if (!qemu_mutex_iothread_locked()) {
+            qemu_mutex_lock_iothread();
+            val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+            qemu_mutex_unlock_iothread();
+        } else {
+            val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+        }
         break;
     case MSR_EFER:
         val = env->efer;
@@ -18,6 +18,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/main-loop.h"
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "exec/log.h"
@@ -46,9 +47,20 @@ void cpu_smm_update(X86CPU *cpu)
 {
     CPUX86State *env = &cpu->env;
     bool smm_enabled = (env->hflags & HF_SMM_MASK);
+    bool locked = false;
 
     if (cpu->smram) {
+        /* helper_rsm gets here from guest code, without the global
+         * lock under MTTCG
+         */
+        if (!qemu_mutex_iothread_locked()) {
+            qemu_mutex_lock_iothread();
+            locked = true;
+        }
         memory_region_set_enabled(cpu->smram, smm_enabled);
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 }
 
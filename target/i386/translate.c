@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -2951,6 +2952,51 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the simple integer MMX/SSE operations inline instead of calling
+ * the per-lane helpers.  SZ is 8 for MMX and 16 for SSE registers.
+ * Returns false if the opcode must go through the helper.  */
+static bool gen_sse_gvec(int b, int op1_offset, int op2_offset, int sz)
+{
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(MO_64, op1_offset, op2_offset, op1_offset, sz, sz);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        tcg_gen_gvec_add(b - 0xfc, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+        tcg_gen_gvec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtl */
+        tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64,
+                         op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74,
+                         op1_offset, op1_offset, op2_offset, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4377,6 +4423,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, op1_offset, op2_offset, is_xmm ? 16 : 8)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -144,6 +144,15 @@ extern bool have_bmi1;
 # define TCG_AREG0 TCG_REG_EBP
 #endif
 
+/* This defines the natural memory order supported by this
+ * architecture before guarantees made by various barrier
+ * instructions.
+ *
+ * The x86 has a pretty strong memory ordering which only really
+ * allows for some stores to be re-ordered after loads.
+ */
+#define TCG_TARGET_DEFAULT_MO (TCG_MO_ALL & ~TCG_MO_ST_LD)
+
 static inline void flush_icache_range(uintptr_t start, uintptr_t stop)
 {
 }
@@ -0,0 +1,397 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+
+typedef void GVecGen2Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a);
+typedef void GVecGen3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+
+static void check_size_align(uint32_t oprsz, uint32_t maxsz, uint32_t ofs)
+{
+    tcg_debug_assert(oprsz > 0 && oprsz <= maxsz);
+    tcg_debug_assert((oprsz & 7) == 0 && (maxsz & 7) == 0);
+    tcg_debug_assert((ofs & 7) == 0);
+}
+
+/* Replicate the low bits of C into each VECE sized element of a uint64_t */
+static uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    case MO_64:
+        return c;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Clear the bytes of the destination between OPRSZ and MAXSZ */
+static void expand_clr(uint32_t dofs, uint32_t oprsz, uint32_t maxsz)
+{
+    TCGv_i64 zero;
+    uint32_t i;
+
+    if (maxsz == oprsz) {
+        return;
+    }
+
+    zero = tcg_const_i64(0);
+    for (i = oprsz; i < maxsz; i += 8) {
+        tcg_gen_st_i64(zero, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(zero);
+}
+
+static void expand_2_i64(unsigned vece, uint32_t dofs, uint32_t aofs,
+                         uint32_t oprsz, uint32_t maxsz, GVecGen2Fn *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs | aofs);
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        if (fni) {
+            fni(vece, t0, t0);
+        }
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+
+    expand_clr(dofs, oprsz, maxsz);
+}
+
+static void expand_3_i64(unsigned vece, uint32_t dofs, uint32_t aofs,
+                         uint32_t bofs, uint32_t oprsz, uint32_t maxsz,
+                         GVecGen3Fn *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        tcg_gen_ld_i64(t1, tcg_ctx.tcg_env, bofs + i);
+        fni(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+
+    expand_clr(dofs, oprsz, maxsz);
+}
+
+/* Return a constant with the most significant bit of each element set */
+static TCGv_i64 const_msb_mask(unsigned vece)
+{
+    return tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+}
+
+/*
+ * Add the elements of A and B without letting carries cross element
+ * boundaries: add everything but the top bit of each element, then
+ * compute the top bits separately as A ^ B ^ carry-in.
+ */
+static void gen_add_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+
+    m = const_msb_mask(vece);
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(m);
+}
+
+/* Same as above, but setting the top bit of each element of A so that
+ * borrows are absorbed before they reach the neighbouring element.  */
+static void gen_sub_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+
+    m = const_msb_mask(vece);
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(m);
+}
+
+static void gen_neg_i64(unsigned vece, TCGv_i64 d, TCGv_i64 b)
+{
+    TCGv_i64 m, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_neg_i64(d, b);
+        return;
+    }
+
+    /* 0 - B with the subtraction above, folding in A == 0 */
+    m = const_msb_mask(vece);
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t3, m, b);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_sub_i64(d, m, t2);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(m);
+}
+
+static void gen_not_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_not_i64(d, a);
+}
+
+static void gen_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_orc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_orc_i64(d, a, b);
+}
+
+void tcg_gen_gvec_mov(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    expand_2_i64(vece, dofs, aofs, oprsz, maxsz, NULL);
+}
+
+void tcg_gen_gvec_not(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    expand_2_i64(vece, dofs, aofs, oprsz, maxsz, gen_not_i64);
+}
+
+void tcg_gen_gvec_neg(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    expand_2_i64(vece, dofs, aofs, oprsz, maxsz, gen_neg_i64);
+}
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3_i64(vece, dofs, aofs, bofs, oprsz, maxsz, gen_add_i64);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3_i64(vece, dofs, aofs, bofs, oprsz, maxsz, gen_sub_i64);
+}
+
+void tcg_gen_gvec_and(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3_i64(vece, dofs, aofs, bofs, oprsz, maxsz, gen_and_i64);
+}
+
+void tcg_gen_gvec_or(unsigned vece, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3_i64(vece, dofs, aofs, bofs, oprsz, maxsz, gen_or_i64);
+}
+
+void tcg_gen_gvec_xor(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    if (aofs == bofs) {
+        /* pxor %xmm0, %xmm0 is the common idiom to clear a register */
+        tcg_gen_gvec_dup_imm(MO_64, dofs, oprsz, maxsz, 0);
+        return;
+    }
+    expand_3_i64(vece, dofs, aofs, bofs, oprsz, maxsz, gen_xor_i64);
+}
+
+void tcg_gen_gvec_andc(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3_i64(vece, dofs, aofs, bofs, oprsz, maxsz, gen_andc_i64);
+}
+
+void tcg_gen_gvec_orc(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    expand_3_i64(vece, dofs, aofs, bofs, oprsz, maxsz, gen_orc_i64);
+}
+
+static void gen_ld_elt_i32(unsigned vece, bool sign, TCGv_i32 t, uint32_t ofs)
+{
+    switch (vece) {
+    case MO_8:
+        if (sign) {
+            tcg_gen_ld8s_i32(t, tcg_ctx.tcg_env, ofs);
+        } else {
+            tcg_gen_ld8u_i32(t, tcg_ctx.tcg_env, ofs);
+        }
+        break;
+    case MO_16:
+        if (sign) {
+            tcg_gen_ld16s_i32(t, tcg_ctx.tcg_env, ofs);
+        } else {
+            tcg_gen_ld16u_i32(t, tcg_ctx.tcg_env, ofs);
+        }
+        break;
+    case MO_32:
+        tcg_gen_ld_i32(t, tcg_ctx.tcg_env, ofs);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void gen_st_elt_i32(unsigned vece, TCGv_i32 t, uint32_t ofs)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_st8_i32(t, tcg_ctx.tcg_env, ofs);
+        break;
+    case MO_16:
+        tcg_gen_st16_i32(t, tcg_ctx.tcg_env, ofs);
+        break;
+    case MO_32:
+        tcg_gen_st_i32(t, tcg_ctx.tcg_env, ofs);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+void tcg_gen_gvec_cmp(TCGCond cond, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    uint32_t esz = 1 << vece;
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+
+    if (vece == MO_64) {
+        TCGv_i64 t0 = tcg_temp_new_i64();
+        TCGv_i64 t1 = tcg_temp_new_i64();
+
+        for (i = 0; i < oprsz; i += 8) {
+            tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+            tcg_gen_ld_i64(t1, tcg_ctx.tcg_env, bofs + i);
+            tcg_gen_setcond_i64(cond, t0, t0, t1);
+            tcg_gen_neg_i64(t0, t0);
+            tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+        }
+        tcg_temp_free_i64(t1);
+        tcg_temp_free_i64(t0);
+    } else {
+        /* Signedness only matters for ordered comparisons, and elements
+         * narrower than 32 bits need to be extended accordingly.  */
+        bool sign = !is_unsigned_cond(cond);
+        TCGv_i32 t0 = tcg_temp_new_i32();
+        TCGv_i32 t1 = tcg_temp_new_i32();
+
+        for (i = 0; i < oprsz; i += esz) {
+            gen_ld_elt_i32(vece, sign, t0, aofs + i);
+            gen_ld_elt_i32(vece, sign, t1, bofs + i);
+            tcg_gen_setcond_i32(cond, t0, t0, t1);
+            tcg_gen_neg_i32(t0, t0);
+            gen_st_elt_i32(vece, t0, dofs + i);
+        }
+        tcg_temp_free_i32(t1);
+        tcg_temp_free_i32(t0);
+    }
+
+    expand_clr(dofs, oprsz, maxsz);
+}
+
+void tcg_gen_gvec_dup_imm(unsigned vece, uint32_t dofs, uint32_t oprsz,
+                          uint32_t maxsz, uint64_t c)
+{
+    TCGv_i64 t;
+    uint32_t i;
+
+    check_size_align(oprsz, maxsz, dofs);
+
+    t = tcg_const_i64(dup_const(vece, c));
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+
+    expand_clr(dofs, oprsz, maxsz);
+}
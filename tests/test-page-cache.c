@@ -0,0 +1,104 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+
+static uint8_t page[PAGE_SIZE];
+
+/* Pages that would share a slot in a direct-mapped cache must coexist */
+static void test_conflicts(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t i;
+
+    for (i = 0; i < 4; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert_cmpint(cache_insert(cache, i * NUM_PAGES * PAGE_SIZE, page,
+                                     0), ==, 0);
+    }
+    for (i = 0; i < 4; i++) {
+        uint64_t addr = i * NUM_PAGES * PAGE_SIZE;
+
+        g_assert(cache_is_cached(cache, addr, 0));
+        g_assert_cmpint(get_cached_data(cache, addr)[0], ==, i);
+    }
+    g_assert(!cache_is_cached(cache, 5 * NUM_PAGES * PAGE_SIZE, 0));
+    g_assert(get_cached_data(cache, 5 * NUM_PAGES * PAGE_SIZE) == NULL);
+
+    cache_fini(cache);
+}
+
+/* A full cache replaces the least recently used page, once it is stale */
+static void test_lru(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t i, evicted = 0, age = 0;
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        int ret = cache_insert(cache, i * PAGE_SIZE, page, age);
+
+        g_assert_cmpint(ret, >=, 0);
+        evicted += ret;
+    }
+
+    /* keep the first page hot */
+    age = 10;
+    g_assert(cache_is_cached(cache, 0, age));
+
+    /* pages that were just inserted are not replaced */
+    g_assert_cmpint(cache_insert(cache, NUM_PAGES * PAGE_SIZE, page, 1),
+                    ==, -1);
+
+    for (i = NUM_PAGES; i < 4 * NUM_PAGES; i++) {
+        g_assert(cache_is_cached(cache, 0, age));
+        evicted += cache_insert(cache, i * PAGE_SIZE, page, age);
+    }
+    g_assert(cache_is_cached(cache, 0, age));
+    g_assert_cmpint(evicted, >, 0);
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t i;
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        memset(page, i, PAGE_SIZE);
+        cache_insert(cache, i * PAGE_SIZE, page, 0);
+    }
+
+    g_assert_cmpint(cache_resize(cache, 4 * NUM_PAGES), ==, 4 * NUM_PAGES);
+    for (i = 0; i < NUM_PAGES; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 0));
+        g_assert_cmpint(get_cached_data(cache, i * PAGE_SIZE)[0], ==, i);
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 4), ==, NUM_PAGES / 4);
+    for (i = 0; i < NUM_PAGES; i++) {
+        uint8_t *data = get_cached_data(cache, i * PAGE_SIZE);
+
+        g_assert(!data || data[0] == i);
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/conflicts", test_conflicts);
+    g_test_add_func("/page-cache/lru", test_lru);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
@@ -174,6 +174,84 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 64
+
+/* Fill @new with runs of equal and differing bytes of random length, so
+ * that run boundaries fall at every offset within a vector.
+ */
+static void fill_runs(uint8_t *old, uint8_t *new, int max_run)
+{
+    int i = 0;
+    bool differ = g_test_rand_int_range(0, 2);
+
+    memcpy(new, old, PAGE_SIZE);
+    while (i < PAGE_SIZE) {
+        int len = g_test_rand_int_range(1, max_run + 1);
+
+        for (; len > 0 && i < PAGE_SIZE; len--, i++) {
+            if (differ) {
+                new[i] = old[i] ^ g_test_rand_int_range(1, 256);
+            }
+        }
+        differ = !differ;
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_PAGES];
+    int i;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        uint8_t *o = old + i * PAGE_SIZE;
+        int j;
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = g_test_rand_int();
+        }
+        /* short runs overflow the output, long ones span many vectors */
+        fill_runs(o, new + i * PAGE_SIZE, i < ACCEL_PAGES / 2 ? 8 : 300);
+        ref_len[i] = -2;
+    }
+
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            uint8_t *o = old + i * PAGE_SIZE;
+            uint8_t *n = new + i * PAGE_SIZE;
+            int dlen;
+
+            dlen = xbzrle_encode_buffer(o, n, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            if (ref_len[i] == -2) {
+                ref_len[i] = dlen;
+                memcpy(ref + i * PAGE_SIZE, compressed, MAX(dlen, 0));
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i]);
+                g_assert(memcmp(ref + i * PAGE_SIZE, compressed,
+                                MAX(dlen, 0)) == 0);
+            }
+
+            if (dlen > 0) {
+                memcpy(decoded, o, PAGE_SIZE);
+                g_assert(xbzrle_decode_buffer(compressed, dlen, decoded,
+                                              PAGE_SIZE) == PAGE_SIZE);
+                g_assert(memcmp(decoded, n, PAGE_SIZE) == 0);
+            }
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+    g_free(decoded);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +264,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* steps through the accelerators, so it must run last */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -0,0 +1,227 @@
+/*
+ * XBZRLE encoder/decoder throughput, for each available accelerator
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE 4096
+
+static unsigned int n_pages = 1024;
+static unsigned int iterations = 20;
+
+static const char commands_string[] =
+    " -n = number of pages per corpus\n"
+    " -i = iterations over each corpus";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ */
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+static uint64_t seed = 1;
+
+static unsigned int rnd(unsigned int n)
+{
+    seed = xorshift64star(seed);
+    return seed % n;
+}
+
+/* A corpus models one kind of page update between two dirty syncs */
+struct corpus {
+    const char *name;
+    void (*mutate)(uint8_t *page);
+};
+
+/* a few scattered counters/flags change */
+static void mutate_sparse(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        page[rnd(PAGE_SIZE)]++;
+    }
+}
+
+/* a couple of cache lines are rewritten */
+static void mutate_lines(uint8_t *page)
+{
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        uint8_t *line = page + rnd(PAGE_SIZE / 64) * 64;
+
+        for (j = 0; j < 64; j++) {
+            line[j] ^= rnd(255) + 1;
+        }
+    }
+}
+
+/* every other byte changes, the encoding overflows */
+static void mutate_dense(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i += 2) {
+        page[i]++;
+    }
+}
+
+/* the page was dirtied but rewritten with the same data */
+static void mutate_none(uint8_t *page)
+{
+}
+
+static const struct corpus corpora[] = {
+    { "sparse",    mutate_sparse },
+    { "lines",     mutate_lines },
+    { "dense",     mutate_dense },
+    { "unchanged", mutate_none },
+};
+
+static uint8_t *old_pages, *new_pages, *encoded, *decoded;
+static int *encoded_len;
+
+static void setup_corpus(const struct corpus *c)
+{
+    unsigned int i;
+
+    seed = 1;
+    for (i = 0; i < n_pages * PAGE_SIZE; i++) {
+        old_pages[i] = rnd(256);
+    }
+    memcpy(new_pages, old_pages, n_pages * PAGE_SIZE);
+    for (i = 0; i < n_pages; i++) {
+        c->mutate(new_pages + i * PAGE_SIZE);
+    }
+}
+
+static double mb_per_sec(int64_t ns)
+{
+    return (double)n_pages * PAGE_SIZE * iterations / ns * 1e9 / (1 << 20);
+}
+
+static void run_corpus(const struct corpus *c)
+{
+    int64_t t, enc_ns, dec_ns;
+    unsigned int i, j;
+    int64_t bytes = 0;
+
+    t = get_clock();
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < n_pages; i++) {
+            encoded_len[i] = xbzrle_encode_buffer(old_pages + i * PAGE_SIZE,
+                                                  new_pages + i * PAGE_SIZE,
+                                                  PAGE_SIZE,
+                                                  encoded + i * PAGE_SIZE,
+                                                  PAGE_SIZE);
+        }
+    }
+    enc_ns = get_clock() - t;
+
+    t = get_clock();
+    for (j = 0; j < iterations; j++) {
+        memcpy(decoded, old_pages, n_pages * PAGE_SIZE);
+        for (i = 0; i < n_pages; i++) {
+            if (encoded_len[i] > 0) {
+                xbzrle_decode_buffer(encoded + i * PAGE_SIZE, encoded_len[i],
+                                     decoded + i * PAGE_SIZE, PAGE_SIZE);
+            }
+        }
+    }
+    dec_ns = get_clock() - t;
+
+    for (i = 0; i < n_pages; i++) {
+        bytes += encoded_len[i] > 0 ? encoded_len[i] :
+                 encoded_len[i] < 0 ? PAGE_SIZE : 0;
+        if (encoded_len[i] >= 0 &&
+            memcmp(decoded + i * PAGE_SIZE, new_pages + i * PAGE_SIZE,
+                   PAGE_SIZE)) {
+            fprintf(stderr, "%s: page %u does not round-trip\n", c->name, i);
+            exit(1);
+        }
+    }
+
+    printf(" %-8s %-10s encode %9.2f MB/s  decode %9.2f MB/s  "
+           "ratio %5.1f%%\n",
+           xbzrle_encode_accel_name(), c->name,
+           mb_per_sec(enc_ns), mb_per_sec(dec_ns),
+           100.0 * bytes / ((int64_t)n_pages * PAGE_SIZE));
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hn:i:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'n':
+            n_pages = atoi(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        }
+    }
+    if (n_pages == 0 || iterations == 0) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size;
+    int i;
+
+    parse_args(argc, argv);
+
+    size = (size_t)n_pages * PAGE_SIZE;
+    old_pages = g_malloc(size);
+    new_pages = g_malloc(size);
+    encoded = g_malloc(size);
+    decoded = g_malloc(size);
+    encoded_len = g_new(int, n_pages);
+
+    printf("Parameters:\n");
+    printf(" # of pages:  %u\n", n_pages);
+    printf(" iterations:  %u\n", iterations);
+    printf("Results:\n");
+
+    do {
+        for (i = 0; i < ARRAY_SIZE(corpora); i++) {
+            setup_corpus(&corpora[i]);
+            run_corpus(&corpora[i]);
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_pages);
+    g_free(new_pages);
+    g_free(encoded);
+    g_free(decoded);
+    g_free(encoded_len);
+    return 0;
+}
@@ -21,6 +21,7 @@
 #include "qemu-common.h"
 #include "qom/cpu.h"
 #include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 
 uintptr_t qemu_real_host_page_size;
 intptr_t qemu_real_host_page_mask;
@@ -30,9 +31,19 @@ intptr_t qemu_real_host_page_mask;
 static void tcg_handle_interrupt(CPUState *cpu, int mask)
 {
     int old_mask;
+    bool need_lock = !qemu_mutex_iothread_locked();
 
+    /* interrupt_request is protected by the global lock; with MTTCG a
+     * vCPU may raise an interrupt on itself from a helper without it.
+     */
+    if (need_lock) {
+        qemu_mutex_lock_iothread();
+    }
     old_mask = cpu->interrupt_request;
     cpu->interrupt_request |= mask;
+    if (need_lock) {
+        qemu_mutex_unlock_iothread();
+    }
 
     /*
      * If called from iothread context, wake the target cpu in